@@ -24,7 +24,9 @@ static void usage(const char *name)
     printf(
         "run a malloc benchmark.\n"
         "usage: %s [-s blk-size|blk-min:blk-max] [-l loop-count] "
-        "[-n num-blocks] [-c]\n",
+        "[-n num-blocks] [-c] [-a append-size]\n"
+        "with -a, append num-blocks pools of append-size bytes instead, "
+        "each after\nfilling the heap with blocks of blk-size.\n",
         name);
     exit(-1);
 }
@@ -115,20 +117,76 @@ static void run_alloc_benchmark(size_t loops,
 static size_t max_size;
 static void *mem = 0;
 
-void *tlsf_resize(tlsf_t *_t, size_t req_size)
+static void *bench_resize(tlsf_t *_t, size_t req_size)
 {
     (void) _t;
     return req_size <= max_size ? mem : 0;
 }
 
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    int err = clock_gettime(CLOCK_MONOTONIC, &now);
+    assert(err == 0);
+    return (double) (now.tv_sec - start->tv_sec) +
+           (double) (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/* Grow the heap by appending pools of @chunk bytes right behind the arena.
+ * Before each append, the free memory is used up, so that the last block is
+ * in use. The mean latency of tlsf_append_pool() is reported each time the
+ * heap has doubled in size.
+ */
+static void run_append_benchmark(size_t appends,
+                                 size_t chunk,
+                                 size_t blk_min,
+                                 size_t blk_max,
+                                 bool clear)
+{
+    void *first = tlsf_malloc(&t, blk_min);
+    assert(first);
+
+    double sum = 0;
+    size_t count = 0, report = 2 * t.size;
+    for (size_t i = 0; i < appends; i++) {
+        /* Halve the size of the request whenever it fails, down to one byte,
+         * which takes even the smallest free block.
+         */
+        for (size_t size = get_random_block_size(blk_min, blk_max); size;) {
+            void *p = tlsf_malloc_hint(&t, size, TLSF_HINT_NOGROW);
+            if (!p)
+                size /= 2;
+            else if (clear)
+                memset(p, 0, size);
+        }
+
+        struct timespec start;
+        int err = clock_gettime(CLOCK_MONOTONIC, &start);
+        assert(err == 0);
+        size_t appended = tlsf_append_pool(&t, (char *) mem + t.size, chunk);
+        sum += elapsed_since(&start);
+        assert(appended == chunk);
+
+        count++;
+        if (t.size >= report || i + 1 == appends) {
+            printf("heap %zu KiB: ~%.3f us per append of %zu bytes\n",
+                   t.size >> 10, sum / (double) count * 1e6, chunk);
+            sum = 0;
+            count = 0;
+            report = 2 * t.size;
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     size_t blk_min = 512, blk_max = 512, num_blks = 10000;
     size_t loops = 10000000;
+    size_t append = 0;
     bool clear = false;
     int opt;
 
-    while ((opt = getopt(argc, argv, "s:l:r:t:n:b:ch")) > 0) {
+    while ((opt = getopt(argc, argv, "s:l:r:t:n:b:ca:h")) > 0) {
         switch (opt) {
         case 's':
             parse_size_arg(optarg, argv[0], &blk_min, &blk_max);
@@ -142,6 +200,9 @@ int main(int argc, char **argv)
         case 'c':
             clear = true;
             break;
+        case 'a':
+            append = parse_int_arg(optarg, argv[0]);
+            break;
         case 'h':
             usage(argv[0]);
             break;
@@ -151,8 +212,26 @@ int main(int argc, char **argv)
         }
     }
 
+    if (append) {
+        /* Appending uses the whole pool at once, so it must be aligned. */
+        if (append % sizeof(void *) || append < 64)
+            usage(argv[0]);
+        max_size = blk_max + 64 + append * num_blks;
+        mem = malloc(max_size);
+        assert(mem);
+        /* Fault the pools in up front, so that only the allocator is timed.
+         * Zeroing could be turned into a calloc(), which does not.
+         */
+        memset(mem, 0xa5, max_size);
+        t.resize = bench_resize;
+        run_append_benchmark(num_blks, append, blk_min, blk_max, clear);
+        free(mem);
+        return 0;
+    }
+
     max_size = blk_max * num_blks;
     mem = malloc(max_size);
+    t.resize = bench_resize;
 
     void **blk_array = (void **) calloc(num_blks, sizeof(void *));
     assert(blk_array);
@@ -0,0 +1,350 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/* Per-operation hardware counters for the allocator hot path. The internal
+ * functions are measured as well, so the allocator is included directly.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "tlsf.h"
+
+static size_t arena_size;
+static void *arena;
+
+/* A fixed arena, whose resize is inlined into the allocator. */
+static inline void *bench_resize(tlsf_t *_t, size_t req_size)
+{
+    (void) _t;
+    return req_size <= arena_size ? arena : 0;
+}
+
+#define TLSF_RESIZE bench_resize
+#include "tlsf.c"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+enum {
+    EV_CYCLES,
+    EV_INSTRUCTIONS,
+    EV_BRANCH_MISSES,
+    EV_L1D_MISSES,
+    EV_LLC_MISSES,
+    EV_COUNT,
+};
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[EV_COUNT] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"l1d_misses", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+         PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    {"llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+};
+
+/* Position of each event in the group read, -1 if it is not available. */
+static int ev_slot[EV_COUNT];
+static int group_fd = -1;
+static unsigned ev_open;
+
+/* Without perf events, cycles are approximated by the time stamp counter
+ * or, lacking that, by nanoseconds.
+ */
+static const char *source;
+
+static tlsf_t heap = TLSF_INIT;
+
+static void counters_open(void)
+{
+    for (int i = 0; i < EV_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = group_fd < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int fd =
+            (int) syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+        ev_slot[i] = fd < 0 ? -1 : (int) ev_open++;
+        if (fd >= 0 && group_fd < 0)
+            group_fd = fd;
+        if (i == EV_CYCLES && fd < 0)
+            break;
+    }
+
+    if (group_fd >= 0) {
+        source = "perf";
+        return;
+    }
+    for (int i = 0; i < EV_COUNT; i++)
+        ev_slot[i] = -1;
+#if defined(__x86_64__) || defined(__i386__)
+    source = "tsc";
+#else
+    source = "ns";
+#endif
+}
+
+static uint64_t clock_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static uint64_t clock_start;
+
+static void counters_start(void)
+{
+    if (group_fd >= 0) {
+        ioctl(group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    } else {
+        clock_start = clock_now();
+    }
+}
+
+/* Add the counts since counters_start() to @sum. */
+static void counters_stop(uint64_t sum[EV_COUNT])
+{
+    if (group_fd < 0) {
+        sum[EV_CYCLES] += clock_now() - clock_start;
+        return;
+    }
+
+    ioctl(group_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t buf[1 + EV_COUNT];
+    if (read(group_fd, buf, sizeof(buf)) < (ssize_t) sizeof(uint64_t))
+        return;
+    for (int i = 0; i < EV_COUNT; i++) {
+        if (ev_slot[i] >= 0 && (uint64_t) ev_slot[i] < buf[0])
+            sum[i] += buf[1 + ev_slot[i]];
+    }
+}
+
+/* Keep results alive, and stop the compiler from hoisting loop bodies
+ * which only read the heap.
+ */
+static volatile size_t sink;
+
+static inline void compiler_barrier(void)
+{
+    __asm__ __volatile__("" : : : "memory");
+}
+
+static void bench_mapping(size_t size, size_t n, uint64_t sum[EV_COUNT])
+{
+    size_t acc = 0;
+    counters_start();
+    for (size_t i = 0; i < n; i++) {
+        uint32_t fl, sl;
+        mapping(size + (i & 7) * ALIGN_SIZE, &fl, &sl);
+        acc += fl + sl;
+        compiler_barrier();
+    }
+    counters_stop(sum);
+    sink = acc;
+}
+
+static void bench_find(size_t size, size_t n, uint64_t sum[EV_COUNT])
+{
+    size_t acc = 0;
+    counters_start();
+    for (size_t i = 0; i < n; i++) {
+        uint32_t fl, sl;
+        mapping(round_block_size(size + (i & 7) * ALIGN_SIZE), &fl, &sl);
+        acc += (size_t) block_find_suitable(&heap, &fl, &sl);
+        compiler_barrier();
+    }
+    counters_stop(sum);
+    sink = acc;
+}
+
+static void bench_malloc(size_t size,
+                         void **p,
+                         size_t n,
+                         uint64_t sum[EV_COUNT])
+{
+    counters_start();
+    for (size_t i = 0; i < n; i++)
+        p[i] = tlsf_malloc(&heap, size);
+    counters_stop(sum);
+    for (size_t i = n; i--;)
+        tlsf_free(&heap, p[i]);
+}
+
+static void bench_free(size_t size,
+                       void **p,
+                       size_t n,
+                       uint64_t sum[EV_COUNT])
+{
+    for (size_t i = 0; i < n; i++)
+        p[i] = tlsf_malloc(&heap, size);
+    counters_start();
+    for (size_t i = n; i--;)
+        tlsf_free(&heap, p[i]);
+    counters_stop(sum);
+}
+
+/* Leave the heap with free blocks of many sizes between used ones. */
+static void **fragment(size_t count)
+{
+    void **used = (void **) calloc(count, sizeof(void *));
+    assert(used);
+    for (size_t i = 0; i < count; i++) {
+        used[i] = tlsf_malloc(&heap, (size_t) rand() % 8192 + 16);
+        assert(used[i]);
+    }
+    for (size_t i = 0; i < count; i += 2) {
+        tlsf_free(&heap, used[i]);
+        used[i] = NULL;
+    }
+    return used;
+}
+
+static void report(bool json,
+                   bool *first,
+                   const char *op,
+                   size_t size,
+                   const char *state,
+                   size_t ops,
+                   const uint64_t sum[EV_COUNT])
+{
+    if (json) {
+        printf("%s\n  {\"op\": \"%s\", \"size\": %zu, \"state\": \"%s\", "
+               "\"ops\": %zu, \"source\": \"%s\"",
+               *first ? "[" : ",", op, size, state, ops, source);
+        for (int i = 0; i < EV_COUNT; i++) {
+            if (ev_slot[i] >= 0 || (i == EV_CYCLES && group_fd < 0))
+                printf(", \"%s\": %.2f", events[i].name,
+                       (double) sum[i] / (double) ops);
+            else
+                printf(", \"%s\": null", events[i].name);
+        }
+        putchar('}');
+    } else {
+        if (*first) {
+            printf("op,size,state,ops,source");
+            for (int i = 0; i < EV_COUNT; i++)
+                printf(",%s", events[i].name);
+            putchar('\n');
+        }
+        printf("%s,%zu,%s,%zu,%s", op, size, state, ops, source);
+        for (int i = 0; i < EV_COUNT; i++) {
+            if (ev_slot[i] >= 0 || (i == EV_CYCLES && group_fd < 0))
+                printf(",%.2f", (double) sum[i] / (double) ops);
+            else
+                putchar(',');
+        }
+        putchar('\n');
+    }
+    *first = false;
+}
+
+static void usage(const char *name)
+{
+    printf(
+        "measure hardware counters per allocator operation.\n"
+        "usage: %s [-l repetitions] [-n batch-size] [-j]\n",
+        name);
+    exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = {16, 64, 256, 1024, 4096, 65536, 1 << 20};
+    static const char *const states[] = {"empty", "fragmented"};
+    static const char *const ops[] = {"mapping", "find_suitable", "malloc",
+                                      "free"};
+    size_t reps = 100, batch = 1000;
+    bool json = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:n:jh")) > 0) {
+        switch (opt) {
+        case 'l':
+            reps = (size_t) strtol(optarg, NULL, 0);
+            break;
+        case 'n':
+            batch = (size_t) strtol(optarg, NULL, 0);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (!reps || !batch || errno)
+        usage(argv[0]);
+
+    arena_size = (size_t) 4 << 30;
+    arena = malloc(arena_size);
+    void **p = (void **) calloc(batch, sizeof(void *));
+    assert(arena && p);
+    srand(1);
+    counters_open();
+
+    bool first = true;
+    for (size_t s = 0; s < ARRAY_SIZE(states); s++) {
+        void **used = s ? fragment(4096) : NULL;
+        for (size_t z = 0; z < ARRAY_SIZE(sizes); z++) {
+            for (size_t o = 0; o < ARRAY_SIZE(ops); o++) {
+                uint64_t sum[EV_COUNT] = {0};
+                for (size_t r = 0; r < reps; r++) {
+                    switch (o) {
+                    case 0:
+                        bench_mapping(sizes[z], batch, sum);
+                        break;
+                    case 1:
+                        bench_find(sizes[z], batch, sum);
+                        break;
+                    case 2:
+                        bench_malloc(sizes[z], p, batch, sum);
+                        break;
+                    default:
+                        bench_free(sizes[z], p, batch, sum);
+                        break;
+                    }
+                }
+                report(json, &first, ops[o], sizes[z], states[s],
+                       reps * batch, sum);
+            }
+        }
+        for (size_t i = 0; used && i < 4096; i++)
+            tlsf_free(&heap, used[i]);
+        free(used);
+    }
+    if (json)
+        puts("\n]");
+
+    free(p);
+    free(arena);
+    return 0;
+}
@@ -15,16 +15,56 @@
 #include <unistd.h>
 
 #include "tlsf.h"
+#include "tlsf_epoch.h"
+#include "tlsf_mt.h"
+#include "tlsf_numa.h"
+#include "tlsf_sub.h"
+#ifdef TLSF_ENABLE_PIC
+#include <sys/wait.h>
+#include "tlsf_shared.h"
+#endif
+#ifdef TLSF_ENABLE_PROFILE
+#include "tlsf_prof.h"
+#endif
+#ifdef TLSF_ENABLE_PAGES
+#include "tlsf_pages.h"
+#endif
+#ifdef TLSF_ENABLE_INDEX
+#include "tlsf_index.h"
+#endif
 
 static size_t PAGE;
 static size_t MAX_PAGES;
 static size_t curr_pages = 0;
 static void *start_addr = 0;
+static size_t resize_calls;
+static tlsf_numa_t numa;
+static tlsf_mt_t mt;
+static tlsf_epoch_t epoch;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t *epoch_shared;
+static bool epoch_done;
+static void *mt_shared[256];
+
+#ifdef TLSF_ENABLE_PIC
+/* The persistent heap keeps its arena right after the tlsf_t. */
+#define PERSIST_ARENA ((sizeof(tlsf_t) + 63) & ~(size_t) 63)
+static tlsf_t *persist_heap;
+static size_t persist_capacity;
+static tlsf_shared_t *shared_heap;
+
+/* The capacity is passed as the context of the backend. */
+static void *persist_resize(tlsf_t *t, size_t req_size)
+{
+    return req_size <= *(size_t *) t->resize_ctx ? (char *) t + PERSIST_ARENA
+                                                 : NULL;
+}
+#endif
 
 void *tlsf_resize(tlsf_t *t, size_t req_size)
 {
     (void) t;
-
+    resize_calls++;
     if (!start_addr)
         start_addr = mmap(0, MAX_PAGES * PAGE, PROT_READ | PROT_WRITE,
                           MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
@@ -87,7 +127,7 @@ static void random_test(tlsf_t *t, size_t spacelen, const size_t cap)
             memset(data, 0, len);
         data[0] = 0xa5;
 
-        if (i++ == maxitems)
+        if (++i == maxitems)
             break;
     }
 
@@ -164,45 +204,1244 @@ static void large_size_test(tlsf_t *t)
 
 static void append_pool_test(tlsf_t *t)
 {
-    printf("Pool append functionality test\n");
+    printf("Pool append test\n");
+
+    /* Appending needs an arena to append to. */
+    assert(!t->size && !tlsf_append_pool(t, start_addr, 4096));
+
+    /* The arena holds a single used block, so the appended memory forms a
+     * free block of its own, reaching exactly up to the new sentinel. It is
+     * too small for a request rounded up to the next size class.
+     */
+    void *p = tlsf_malloc(t, 1000);
+    assert(p);
+    size_t size = t->size;
+    char *end = (char *) start_addr + size;
+    assert(!tlsf_append_pool(t, end, 16));
+    assert(!tlsf_append_pool(t, end + 4096, 4096));
+    assert(!tlsf_append_pool(t, end + 1, 4096));
+    char separate[2048];
+    assert(!tlsf_append_pool(t, separate, sizeof(separate)));
+    assert(t->size == size);
+
+    assert(tlsf_append_pool(t, end, 4096) == 4096);
+    assert(t->size == size + 4096);
+    assert(!tlsf_malloc_hint(t, 4096, TLSF_HINT_NOGROW));
+    void *q = tlsf_malloc_hint(t, 4096 - 128, TLSF_HINT_NOGROW);
+    assert(q == end);
+    memset(q, 0xa5, 4096 - 128);
+    tlsf_check(t);
+
+    /* A free last block is merged with the appended memory. */
+    t->retain = SIZE_MAX;
+    tlsf_free(t, q);
+    size = t->size;
+    assert(tlsf_append_pool(t, (char *) start_addr + size, 4097) == 4096);
+    assert(t->size == size + 4096);
+    assert(!tlsf_malloc_hint(t, 8192, TLSF_HINT_NOGROW));
+    q = tlsf_malloc_hint(t, 8192 - 256, TLSF_HINT_NOGROW);
+    assert(q == end);
+    memset(q, 0xa5, 8192 - 256);
+    tlsf_check(t);
+
+    t->retain = 0;
+    tlsf_free(t, q);
+    tlsf_free(t, p);
+    assert(!t->size);
+}
+
+static void check_step_test(tlsf_t *t)
+{
+    printf("Incremental check test\n");
+
+    void *p[256];
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++) {
+        p[i] = tlsf_malloc(t, (size_t) rand() % 1000 + 1);
+        assert(p[i]);
+        assert(tlsf_check_step(t, 3));
+    }
+
+    /* Free every other block, stepping while the heap changes under us. */
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i += 2) {
+        tlsf_free(t, p[i]);
+        p[i] = NULL;
+        assert(tlsf_check_step(t, 3));
+    }
+    assert(tlsf_check_step(t, 4 * ARRAY_SIZE(p)));
+
+    /* A used block claiming a free predecessor must be caught. */
+    size_t *header = (size_t *) p[1] - 1;
+    *header ^= 2;
+    assert(!tlsf_check_step(t, 4 * ARRAY_SIZE(p)));
+    *header ^= 2;
+    assert(tlsf_check_step(t, 4 * ARRAY_SIZE(p)));
+
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++) {
+        tlsf_free(t, p[i]);
+        assert(tlsf_check_step(t, 3));
+    }
+    tlsf_check(t);
+}
+
+static void in_place_test(tlsf_t *t)
+{
+    printf("In-place resize test\n");
+
+    char *a = (char *) tlsf_malloc(t, 100);
+    char *b = (char *) tlsf_malloc(t, 100);
+    char *c = (char *) tlsf_malloc(t, 100);
+    assert(a && b && c);
+    memset(a, 0xa5, 100);
+
+    /* A used neighbour blocks expansion, and nothing moves. */
+    assert(!tlsf_try_expand(t, a, 200));
+    assert(tlsf_try_expand(t, a, 64) == a);
+
+    /* A free neighbour is absorbed. */
+    tlsf_free(t, b);
+    assert(tlsf_try_expand(t, a, 200) == a);
+    for (unsigned i = 0; i < 100; i++)
+        assert((uint8_t) a[i] == 0xa5);
+    assert(!tlsf_try_expand(t, a, 1000));
+    tlsf_check(t);
+
+    /* The last block grows the arena. */
+    assert(tlsf_try_expand(t, c, 100000) == c);
+    memset(c, 0, 100000);
+    tlsf_check(t);
+
+    /* Shrinking hands the tail back, so the next allocation fits behind. */
+    tlsf_shrink_in_place(t, c, 100);
+    tlsf_check(t);
+    char *d = (char *) tlsf_malloc(t, 1000);
+    assert(d > c && d < c + 100000);
+    assert(tlsf_check_step(t, 100));
+
+    tlsf_free(t, a);
+    tlsf_free(t, c);
+    tlsf_free(t, d);
+    tlsf_check(t);
+}
+
+static void compact_test(tlsf_t *t)
+{
+    printf("Compaction test\n");
 
-    /* Simple test: Initial allocation */
-    void *ptr1 = tlsf_malloc(t, 1000);
-    assert(ptr1);
+    tlsf_handle_t slots[128], *h[ARRAY_SIZE(slots)];
+    tlsf_handles_t table;
+    tlsf_handles_init(&table, slots, ARRAY_SIZE(slots));
 
-    size_t initial_size = t->size;
+    for (unsigned i = 0; i < ARRAY_SIZE(h); i++) {
+        size_t len = 32 + i * 7;
+        h[i] = tlsf_halloc(t, &table, len);
+        assert(h[i]);
+        memset(tlsf_pin(h[i]), (int) i, len);
+        tlsf_unpin(h[i]);
+    }
+    assert(!tlsf_halloc(t, &table, 16));
+
+    /* Leave holes between the survivors, one of which stays pinned. */
+    for (unsigned i = 0; i < ARRAY_SIZE(h); i += 2) {
+        tlsf_hfree(t, &table, h[i]);
+        h[i] = NULL;
+    }
+    void *pinned = tlsf_pin(h[1]);
+    size_t size = t->size;
 
-    /* Try to append adjacent memory */
-    void *append_addr = (char *) start_addr + initial_size;
-    size_t appended = tlsf_append_pool(t, append_addr, 4096);
+    unsigned calls = 1;
+    while (!tlsf_compact(t, &table, 4)) {
+        calls++;
+        tlsf_check(t);
+    }
+    assert(calls > 1);
+    assert(h[1]->ptr == pinned);
+    assert(t->size < size);
+    tlsf_unpin(h[1]);
+    while (!tlsf_compact(t, &table, 4))
+        ;
+    assert(tlsf_check_step(t, 1000));
 
-    if (appended > 0) {
-        printf("Pool append successful: %zu bytes added\n", appended);
+    for (unsigned i = 1; i < ARRAY_SIZE(h); i += 2) {
+        uint8_t *p = (uint8_t *) tlsf_pin(h[i]);
+        for (size_t j = 0; j < 32 + i * 7; j++)
+            assert(p[j] == i);
+        tlsf_unpin(h[i]);
+        tlsf_hfree(t, &table, h[i]);
+    }
+    assert(!t->size);
+    tlsf_check(t);
+}
+
+/* An arena of 4 KiB, right before an inaccessible page. */
+#define GUARD_ARENA 4096
+
+static void *guard_resize(tlsf_t *t, size_t req_size)
+{
+    return req_size <= GUARD_ARENA ? t->resize_ctx : NULL;
+}
+
+static void compact_end_test(void)
+{
+    printf("Compaction at the arena end test\n");
 
-        /* Test large allocation from expanded pool */
-        void *large_ptr = tlsf_malloc(t, 3000);
-        if (large_ptr) {
-            printf("Large allocation from expanded pool successful\n");
-            tlsf_free(t, large_ptr);
+    char *map = (char *) mmap(0, 2 * PAGE, PROT_READ | PROT_WRITE,
+                              MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(map != MAP_FAILED && !mprotect(map + PAGE, PAGE, PROT_NONE));
+    tlsf_t t = TLSF_INIT;
+    t.resize = guard_resize;
+    t.resize_ctx = map + PAGE - GUARD_ARENA;
+    t.retain = SIZE_MAX;
+
+    /* Each block grows the arena by its size and a header, the second one
+     * by exactly the size class it is rounded up to.
+     */
+    tlsf_handle_t slots[2], *h[2];
+    tlsf_handles_t table;
+    tlsf_handles_init(&table, slots, ARRAY_SIZE(slots));
+    assert((h[0] = tlsf_halloc(&t, &table, 96)));
+    assert((h[1] = tlsf_halloc(&t, &table, 3968 - sizeof(void *))));
+    assert(t.size == GUARD_ARENA);
+
+    /* The free last block is followed by the sentinel, right at the end. */
+    tlsf_hfree(&t, &table, h[1]);
+    assert(t.size == GUARD_ARENA);
+    while (!tlsf_compact(&t, &table, 1))
+        ;
+    assert(t.size == GUARD_ARENA);
+    tlsf_check(&t);
+
+    t.retain = 0;
+    tlsf_hfree(&t, &table, h[0]);
+    assert(!t.size);
+    munmap(map, 2 * PAGE);
+}
+
+static void reset_test(tlsf_t *t)
+{
+    printf("Reset and mark/release test\n");
+
+    void *p[100];
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++)
+        assert((p[i] = tlsf_malloc(t, 64 + i * 13)));
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i += 3)
+        tlsf_free(t, p[i]);
+    size_t size = t->size;
+    tlsf_reset(t);
+    assert(t->size == size);
+    tlsf_check(t);
+    assert(tlsf_check_step(t, 1000));
+    void *big = tlsf_malloc(t, size / 2);
+    assert(big && (char *) big < (char *) p[0] + 64);
+    tlsf_free(t, big);
+    assert(!t->size);
+
+    /* A mark of an empty heap releases everything. */
+    size_t outer, inner;
+    assert(tlsf_mark(t, &outer) && !outer);
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++)
+        assert((p[i] = tlsf_malloc(t, 100)));
+    tlsf_release(t, outer);
+    assert(!t->size);
+
+    /* Nested scopes, with some blocks freed on the way. */
+    void *a = tlsf_malloc(t, 100), *b = tlsf_malloc(t, 200);
+    memset(b, 0xb, 200);
+    assert(tlsf_mark(t, &outer) && outer);
+    void *c = tlsf_malloc(t, 300);
+    memset(c, 0xc, 300);
+    assert(c > b);
+    tlsf_free(t, a);
+    assert(tlsf_mark(t, &inner) && inner > outer);
+    size = t->size;
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++)
+        assert((p[i] = tlsf_malloc(t, 1000)) > c);
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i += 2)
+        tlsf_free(t, p[i]);
+    tlsf_check(t);
+    tlsf_release(t, inner);
+    assert(t->size < size);
+    tlsf_check(t);
+    for (unsigned i = 0; i < 300; i++)
+        assert(((uint8_t *) c)[i] == 0xc);
+    tlsf_free(t, b);
+    tlsf_release(t, outer);
+    tlsf_check(t);
+    assert(tlsf_check_step(t, 1000));
+    assert(!t->size);
+
+    /* Checking and compaction resume across a release which keeps the
+     * released memory, with their cursors inside of it.
+     */
+    t->retain = 1 << 20;
+    tlsf_handle_t slots[50], *h[ARRAY_SIZE(slots)];
+    tlsf_handles_t table;
+    tlsf_handles_init(&table, slots, ARRAY_SIZE(slots));
+    a = tlsf_malloc(t, 100);
+    assert(tlsf_mark(t, &outer));
+    for (unsigned i = 0; i < ARRAY_SIZE(h); i++)
+        assert((h[i] = tlsf_halloc(t, &table, 1000)));
+    for (unsigned i = 0; i < ARRAY_SIZE(h); i += 2)
+        tlsf_hfree(t, &table, h[i]);
+    assert(tlsf_check_step(t, 30));
+    assert(!tlsf_compact(t, &table, 10));
+    size = t->size;
+    tlsf_release(t, outer);
+    assert(t->size == size);
+    assert(tlsf_check_step(t, 1000));
+    while (!tlsf_compact(t, &table, 4))
+        ;
+    tlsf_check(t);
+    tlsf_free(t, a);
+    t->retain = 0;
+    tlsf_trim(t, 0);
+    assert(!t->size);
+}
+
+static void policy_test(tlsf_t *t)
+{
+    printf("Resize policy test\n");
+
+    /* By default, allocating and freeing at the tail resizes every time. */
+    size_t calls = resize_calls;
+    for (unsigned i = 0; i < 100; i++)
+        tlsf_free(t, tlsf_malloc(t, 1000));
+    assert(resize_calls - calls == 200);
+
+    /* Retained tail memory is reused without the backend. */
+    t->retain = 65536;
+    calls = resize_calls;
+    for (unsigned i = 0; i < 100; i++)
+        tlsf_free(t, tlsf_malloc(t, 1000));
+    assert(resize_calls - calls == 1);
+    assert(t->size > 1000);
+    tlsf_check(t);
+
+    /* A large free tail is released down to the retained size. */
+    tlsf_free(t, tlsf_malloc(t, 1 << 20));
+    assert(t->size > 65536 && t->size < 65536 + 4096);
+    tlsf_trim(t, 0);
+    assert(!t->size);
+    t->retain = 0;
+
+    /* Geometric growth needs few backend calls for many allocations. */
+    void *p[1000];
+    t->grow_pct = 50;
+    t->grow_step = 4096;
+    calls = resize_calls;
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++)
+        assert((p[i] = tlsf_malloc(t, 500)));
+    assert(resize_calls - calls < 20);
+    assert(t->size % 4096 == 0);
+    tlsf_check(t);
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++)
+        tlsf_free(t, p[i]);
+    assert(!t->size);
+    t->grow_pct = 0;
+    t->grow_step = 0;
+}
+
+static size_t low_calls, low_avail;
+
+static void low_water(tlsf_t *t, size_t avail)
+{
+    (void) t;
+    low_calls++;
+    low_avail = avail;
+}
+
+/* A backend which has lost the arena, e.g. a detached mapping */
+static void *lost_resize(tlsf_t *t, size_t req_size)
+{
+    (void) t;
+    (void) req_size;
+    return NULL;
+}
+
+static void reserve_test(tlsf_t *t)
+{
+    printf("Reserve and no-grow test\n");
+
+    /* A no-grow heap only allocates from memory reserved beforehand. */
+    t->hints = TLSF_HINT_NOGROW;
+    assert(!tlsf_malloc(t, 100) && !t->size);
+    assert(tlsf_reserve(t, 65536) && t->size > 65536);
+    assert(tlsf_reserve(t, 65536));
+    t->retain = SIZE_MAX;
+    t->low_water = 16384;
+    t->low = low_water;
+
+    void *p[100];
+    unsigned n = 0;
+    size_t calls = resize_calls;
+    while ((p[n] = tlsf_malloc(t, 1000)))
+        assert(++n < ARRAY_SIZE(p));
+    assert(resize_calls == calls);
+    assert(n >= 60 && low_calls > 1 && !low_avail);
+    assert(!tlsf_realloc(t, p[n - 1], 10000));
+
+    /* Used up to the end, the arena has no room for a mark either. The
+     * smallest blocks are chained through their first word.
+     */
+    void **chain = NULL, **q;
+    while ((q = (void **) tlsf_malloc(t, 1))) {
+        *q = chain;
+        chain = q;
+    }
+    size_t mark, low = low_calls, used = t->size;
+    assert(!tlsf_mark(t, &mark) && low_calls == low + 1 && t->size == used);
+    calls = resize_calls; /* for the start of the arena, not to grow it */
+    for (; chain; chain = q) {
+        q = (void **) *chain;
+        tlsf_free(t, chain);
+    }
+
+    /* Freeing at the end keeps the reserve. */
+    size_t size = t->size;
+    tlsf_free(t, p[--n]);
+    assert(t->size == size && resize_calls == calls);
+    tlsf_check(t);
+
+    /* Growth is only refused when asked for. */
+    t->hints = 0;
+    t->low = NULL;
+    assert(!tlsf_malloc_hint(t, 1 << 20, TLSF_HINT_NOGROW));
+    assert((p[n] = tlsf_malloc_hint(t, 1 << 20, 0)) && t->size > size);
+    for (unsigned i = 0; i <= n; i++)
+        tlsf_free(t, p[i]);
+    assert(t->size);
+
+    /* Without the arena, nothing is changed. */
+    size = t->size;
+    t->resize = lost_resize;
+    assert(!tlsf_reserve(t, 2 * size) && !tlsf_mark(t, &mark));
+    tlsf_trim(t, 0);
+    tlsf_reset(t);
+    tlsf_release(t, 0);
+    t->resize = NULL;
+    assert(t->size == size);
+    tlsf_check(t);
+
+    t->retain = 0;
+    t->low_water = 0;
+    tlsf_trim(t, 0);
+    assert(!t->size);
+}
+
+static void lifetime_test(tlsf_t *t)
+{
+    printf("Lifetime hint test\n");
+
+    t->retain = SIZE_MAX;
+    assert(tlsf_reserve(t, 1 << 20));
+
+    /* Short-lived blocks come and go at the end of the free space, so
+     * long-lived ones allocated meanwhile are packed at its start.
+     */
+    void *lng[64], *shrt[8];
+    const size_t align = (size_t) 1 << _TLSF_ALIGN_SHIFT;
+    const size_t stride = ((200 + align - 1) & ~(align - 1)) + sizeof(size_t);
+    for (unsigned i = 0; i < ARRAY_SIZE(lng); i++) {
+        for (unsigned j = 0; j < ARRAY_SIZE(shrt); j++)
+            assert((shrt[j] = tlsf_malloc_hint(t, 1000 + j * 100,
+                                               TLSF_HINT_SHORT_LIVED)));
+        assert((lng[i] = tlsf_malloc_hint(t, 200, TLSF_HINT_LONG_LIVED)));
+        assert(!i || (char *) lng[i] == (char *) lng[i - 1] + stride);
+        for (unsigned j = 0; j < ARRAY_SIZE(shrt); j++) {
+            assert((char *) shrt[j] > (char *) lng[i] + 65536);
+            tlsf_free(t, shrt[j]);
         }
-    } else {
-        printf("Pool append not possible (non-adjacent memory)\n");
     }
+    tlsf_check(t);
+
+    /* The rest of the arena is still in one piece. */
+    size_t calls = resize_calls;
+    void *p = tlsf_malloc_hint(t, 900000, TLSF_HINT_NOGROW);
+    assert(p && resize_calls == calls);
+    tlsf_free(t, p);
+
+    /* Among several fitting blocks, the hints pick the lowest or highest,
+     * wherever they are in the free list.
+     */
+    static const unsigned order[] = {1, 3, 0, 2};
+    void *big[4], *sep[4];
+    for (unsigned i = 0; i < ARRAY_SIZE(big); i++) {
+        assert((big[i] = tlsf_malloc(t, 10000)));
+        assert((sep[i] = tlsf_malloc(t, 16)));
+    }
+    for (unsigned i = 0; i < ARRAY_SIZE(order); i++)
+        tlsf_free(t, big[order[i]]);
+    assert((p = tlsf_malloc_hint(t, 10000, TLSF_HINT_LONG_LIVED)) == big[0]);
+    tlsf_free(t, p);
+    p = tlsf_malloc_hint(t, 9000, TLSF_HINT_SHORT_LIVED);
+    assert((char *) p > (char *) big[3] && (char *) p < (char *) sep[3]);
+    tlsf_free(t, p);
+    for (unsigned i = 0; i < ARRAY_SIZE(sep); i++)
+        tlsf_free(t, sep[i]);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(lng); i++)
+        tlsf_free(t, lng[i]);
+    tlsf_check(t);
+    t->retain = 0;
+    tlsf_trim(t, 0);
+    assert(!t->size);
+}
+
+static void order_test(tlsf_t *t)
+{
+    printf("Address order test\n");
+
+    /* Free large blocks from low to high addresses, kept apart by small
+     * ones. LIFO bins hand out the last one freed, the highest.
+     */
+    void *big[8], *small[8];
+    for (unsigned i = 0; i < ARRAY_SIZE(big); i++) {
+        assert((big[i] = tlsf_malloc(t, 10000)));
+        assert((small[i] = tlsf_malloc(t, 16)));
+    }
+    for (unsigned i = 0; i < ARRAY_SIZE(big); i++)
+        tlsf_free(t, big[i]);
+    void *p = tlsf_malloc(t, 10000);
+    assert(p == big[ARRAY_SIZE(big) - 1]);
+    tlsf_free(t, p);
+
+    /* Ordered bins hand out the lowest one, whatever the order of frees. */
+    t->order_min = 4096;
+    void *low = NULL;
+    for (unsigned i = 0; i < ARRAY_SIZE(big); i++) {
+        assert((big[i] = tlsf_malloc(t, 10000)));
+        if (!low || big[i] < low)
+            low = big[i];
+    }
+    tlsf_free(t, low);
+    for (unsigned i = 0; i < ARRAY_SIZE(big); i++) {
+        if (big[i] != low)
+            tlsf_free(t, big[i]);
+    }
+    tlsf_check(t);
+    assert((big[0] = tlsf_malloc(t, 10000)) == low);
+    for (unsigned i = 1; i < ARRAY_SIZE(big); i++)
+        assert((big[i] = tlsf_malloc(t, 10000)) > big[i - 1]);
+    for (unsigned i = ARRAY_SIZE(big); i--;)
+        tlsf_free(t, big[i]);
+    tlsf_check(t);
+    t->order_min = 0;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(small); i++)
+        tlsf_free(t, small[i]);
+    assert(!t->size);
+}
+
+static void sub_heap_test(tlsf_t *t)
+{
+    printf("Sub-heap test\n");
+
+    tlsf_t *sub = tlsf_sub_create(t, 0);
+    assert(sub && !sub->size);
+
+    /* The sub-heap grows by expanding its block, which is last. */
+    void *p[64];
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++) {
+        assert((p[i] = tlsf_malloc(sub, 100 + i * 50)));
+        memset(p[i], (int) i, 100 + i * 50);
+    }
+    size_t size = sub->size;
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i += 2)
+        tlsf_free(sub, p[i]);
+    tlsf_free(sub, p[ARRAY_SIZE(p) - 1]);
+    assert(sub->size < size);
+    tlsf_check(sub);
 
-    /* Test non-adjacent append (should fail) */
-    char separate_memory[2048];
-    size_t non_adjacent =
-        tlsf_append_pool(t, separate_memory, sizeof(separate_memory));
-    assert(non_adjacent == 0);
-    printf("Non-adjacent append correctly rejected\n");
+    /* Nested sub-heap with a reserve, which keeps growing behind a parent
+     * allocation that blocks the outer sub-heap.
+     */
+    tlsf_t *inner = tlsf_sub_create(sub, 4096);
+    void *wall = tlsf_malloc(t, 16);
+    assert(inner && wall);
+    assert(!tlsf_malloc(sub, 100000));
+    void *q = tlsf_malloc(inner, 3000);
+    assert(q && (char *) q > (char *) inner && (char *) q < (char *) wall);
+    assert(!tlsf_malloc(inner, 100000));
+    tlsf_free(inner, q);
+    tlsf_check(inner);
+    tlsf_check(sub);
+    tlsf_check(t);
 
-    tlsf_free(t, ptr1);
+    for (unsigned i = 1; i < ARRAY_SIZE(p) - 1; i += 2) {
+        for (size_t j = 0; j < 100 + i * 50; j++)
+            assert(((uint8_t *) p[i])[j] == i);
+    }
+    tlsf_sub_destroy(sub);
+    tlsf_free(t, wall);
     tlsf_check(t);
-    printf("Pool append test completed\n");
+    assert(!t->size);
 }
 
-int main(void)
+#ifdef TLSF_ENABLE_TAGS
+static void tag_test(tlsf_t *t)
 {
+    printf("Tag accounting test\n");
+
+    tlsf_tag_stat_t before[TLSF_TAG_COUNT], stats[TLSF_TAG_COUNT];
+    tlsf_tag_stats(t, before);
+    /* Everything allocated by the previous tests has been freed. */
+    assert(!before[0].count && !before[0].bytes);
+
+    void *a = tlsf_malloc_tagged(t, 100, 1);
+    void *b = tlsf_aalloc_tagged(t, 64, 640, 2);
+    void *c = tlsf_malloc_tagged(t, 1000, 2);
+    assert(a && b && c && !((size_t) b % 64));
+    tlsf_tag_stats(t, stats);
+    assert(stats[1].count == before[1].count + 1);
+    assert(stats[1].bytes >= before[1].bytes + 100);
+    assert(stats[2].count == before[2].count + 2);
+    assert(stats[2].bytes >= before[2].bytes + 1640);
+    assert(stats[0].count == before[0].count);
+
+    /* The tag follows the block when it is resized or relocated. */
+    void *d = tlsf_malloc(t, 16);
+    a = tlsf_realloc(t, a, 5000);
+    assert(a);
+    tlsf_shrink_in_place(t, c, 200);
+    tlsf_tag_stats(t, stats);
+    assert(stats[1].count == before[1].count + 1);
+    assert(stats[1].bytes >= before[1].bytes + 5000);
+    assert(stats[2].bytes < before[2].bytes + 1640);
+    assert(stats[0].count == before[0].count + 1);
+    tlsf_check(t);
+
+    tlsf_free(t, a);
+    tlsf_free(t, b);
+    tlsf_free(t, c);
+    tlsf_free(t, d);
+    tlsf_tag_stats(t, stats);
+    assert(!memcmp(stats, before, sizeof(stats)));
+    tlsf_check(t);
+}
+#endif
+
+#ifdef TLSF_ENABLE_PROFILE
+/* Read the totals of a profile: live count and bytes, then allocated ones. */
+static void prof_totals(tlsf_t *t, size_t total[4], size_t *interval)
+{
+    FILE *f = tmpfile();
+    assert(f);
+    assert(!tlsf_prof_dump(t, f));
+    rewind(f);
+    assert(fscanf(f, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                  &total[0], &total[1], &total[2], &total[3], interval) == 5);
+
+    char line[512];
+    bool libraries = false;
+    while (fgets(line, sizeof(line), f))
+        libraries |= !strcmp(line, "MAPPED_LIBRARIES:\n");
+    assert(libraries);
+    fclose(f);
+}
+
+static void prof_test(tlsf_t *t)
+{
+    printf("Sampling profiler test\n");
+
+    /* Without a profiler nothing is sampled. */
+    void *a = tlsf_malloc(t, 100);
+    assert(a && t->prof_countdown > 0);
+    tlsf_free(t, a);
+
+    size_t total[4], interval;
+    void *p[1000];
+    assert(!tlsf_prof_start(t, 4096));
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++)
+        p[i] = tlsf_malloc(t, 256);
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i += 2)
+        tlsf_free(t, p[i]);
+    prof_totals(t, total, &interval);
+    assert(interval == 4096);
+    /* About 62 of the 256000 bytes are expected to be sampled. */
+    assert(total[2] > 20 && total[2] < 200);
+    assert(total[3] == 256 * total[2]);
+    assert(total[0] < total[2] && total[1] == 256 * total[0]);
+    for (unsigned i = 1; i < ARRAY_SIZE(p); i += 2)
+        tlsf_free(t, p[i]);
+    prof_totals(t, total, &interval);
+    assert(!total[0] && !total[1]);
+
+    /* Sampled blocks are followed when compaction moves them. */
+    tlsf_handle_t slots[64];
+    tlsf_handles_t table;
+    tlsf_handles_init(&table, slots, ARRAY_SIZE(slots));
+    assert(!tlsf_prof_start(t, 1));
+    for (unsigned i = 0; i < ARRAY_SIZE(slots); i++)
+        assert(tlsf_halloc(t, &table, 48));
+    for (unsigned i = 0; i < ARRAY_SIZE(slots); i += 2)
+        tlsf_hfree(t, &table, &slots[i]);
+    while (!tlsf_compact(t, &table, 16))
+        ;
+    for (unsigned i = 1; i < ARRAY_SIZE(slots); i += 2)
+        tlsf_hfree(t, &table, &slots[i]);
+    prof_totals(t, total, &interval);
+    assert(total[2] == ARRAY_SIZE(slots) && !total[0]);
+
+    tlsf_prof_stop(t);
+    assert(tlsf_prof_dump(t, stdout) < 0);
+    tlsf_check(t);
+}
+#endif
+
+static void *numa_worker(void *arg)
+{
+    (void) arg;
+    void *p[64] = {0};
+    for (unsigned i = 0; i < 20000; i++) {
+        unsigned k = (unsigned) rand() % ARRAY_SIZE(p);
+        tlsf_numa_free(&numa, p[k]);
+        p[k] = tlsf_numa_malloc(&numa, (size_t) rand() % 4096 + 1);
+        assert(p[k] && tlsf_numa_node_of(&numa, p[k]) >= 0);
+        memset(p[k], 0x5a, 1);
+    }
+    for (unsigned k = 0; k < ARRAY_SIZE(p); k++)
+        tlsf_numa_free(&numa, p[k]);
+    return NULL;
+}
+
+static void numa_test(void)
+{
+    printf("NUMA arena test\n");
+
+    assert(!tlsf_numa_init(&numa, 64 << 20));
+    assert(numa.count >= 1);
+    printf("%u node arena(s)\n", numa.count);
+
+    pthread_t threads[4];
+    for (unsigned i = 0; i < ARRAY_SIZE(threads); i++)
+        assert(!pthread_create(&threads[i], NULL, numa_worker, NULL));
+    for (unsigned i = 0; i < ARRAY_SIZE(threads); i++)
+        pthread_join(threads[i], NULL);
+
+    for (unsigned i = 0; i < numa.count; i++) {
+        tlsf_check(&numa.arena[i].tlsf);
+        assert(!numa.arena[i].tlsf.size);
+    }
+    int local;
+    assert(tlsf_numa_node_of(&numa, &local) < 0);
+    tlsf_numa_destroy(&numa);
+}
+
+/* Allocate, free and hand blocks over to other threads, so that frees often
+ * hit an arena locked by another thread.
+ */
+static void *mt_worker(void *arg)
+{
+    unsigned seed = (unsigned) (size_t) arg;
+    void *p[32] = {0};
+    for (unsigned i = 0; i < 50000; i++) {
+        unsigned k = (unsigned) rand_r(&seed) % ARRAY_SIZE(p);
+        tlsf_mt_free(&mt, p[k]);
+        size_t size = (size_t) rand_r(&seed) % 2048 + 1;
+        p[k] = i % 7 ? tlsf_mt_malloc(&mt, size)
+                     : tlsf_mt_aalloc(&mt, 64, (size + 63) & ~(size_t) 63);
+        assert(p[k]);
+        memset(p[k], (int) k, size);
+        if (i % 3 == 0) {
+            unsigned s = (unsigned) rand_r(&seed) % ARRAY_SIZE(mt_shared);
+            p[k] = __atomic_exchange_n(&mt_shared[s], p[k], __ATOMIC_ACQ_REL);
+        }
+    }
+    for (unsigned k = 0; k < ARRAY_SIZE(p); k++)
+        tlsf_mt_free(&mt, p[k]);
+    return NULL;
+}
+
+static void mt_test(void)
+{
+    printf("Concurrent heap test\n");
+
+    assert(!tlsf_mt_init(&mt, 4, 16 << 20));
+    assert(mt.count == 4);
+
+    pthread_t threads[8];
+    for (unsigned i = 0; i < ARRAY_SIZE(threads); i++)
+        assert(!pthread_create(&threads[i], NULL, mt_worker,
+                               (void *) (size_t) (i + 1)));
+    for (unsigned i = 0; i < ARRAY_SIZE(threads); i++)
+        pthread_join(threads[i], NULL);
+    for (unsigned i = 0; i < ARRAY_SIZE(mt_shared); i++)
+        tlsf_mt_free(&mt, mt_shared[i]);
+
+    void *p = tlsf_mt_realloc(&mt, NULL, 100);
+    assert(p && (p = tlsf_mt_realloc(&mt, p, 10000)));
+    tlsf_mt_free(&mt, p);
+    tlsf_mt_flush(&mt);
+    for (unsigned i = 0; i < mt.count; i++) {
+        tlsf_check(&mt.arena[i].tlsf);
+        assert(!mt.arena[i].tlsf.size);
+    }
+    tlsf_mt_destroy(&mt);
+}
+
+/* Read the shared block until the writer is done. Each block holds its own
+ * number and its complement, which freeing or reusing it too early would
+ * overwrite with free-list links or the number of another block.
+ */
+static void *epoch_reader(void *arg)
+{
+    (void) arg;
+    tlsf_epoch_slot_t *s = tlsf_epoch_register(&epoch);
+    assert(s);
+    while (!__atomic_load_n(&epoch_done, __ATOMIC_ACQUIRE)) {
+        tlsf_epoch_enter(&epoch, s);
+        size_t *p = __atomic_load_n(&epoch_shared, __ATOMIC_ACQUIRE);
+        size_t n = __atomic_load_n(&p[0], __ATOMIC_RELAXED);
+        for (unsigned i = 0; i < 1000; i++)
+            assert(__atomic_load_n(&p[i % 4], __ATOMIC_RELAXED) ==
+                   (i % 2 ? ~n : n));
+        tlsf_epoch_exit(&epoch, s);
+    }
+    tlsf_epoch_unregister(&epoch, s);
+    return NULL;
+}
+
+static size_t *epoch_node(tlsf_t *t)
+{
+    static size_t count;
+    pthread_mutex_lock(&epoch_lock);
+    size_t *p = (size_t *) tlsf_malloc(t, 4 * sizeof(size_t));
+    pthread_mutex_unlock(&epoch_lock);
+    assert(p);
+    count++;
+    for (unsigned i = 0; i < 4; i++)
+        p[i] = i % 2 ? ~count : count;
+    return p;
+}
+
+/* A short-lived writer, which retires a block and exits. */
+static void *epoch_churn(void *arg)
+{
+    tlsf_epoch_slot_t *s = tlsf_epoch_register(&epoch);
+    assert(s);
+    tlsf_epoch_retire(&epoch, s, epoch_node((tlsf_t *) arg));
+    tlsf_epoch_unregister(&epoch, s);
+    return s;
+}
+
+static void epoch_test(tlsf_t *t)
+{
+    printf("Epoch reclamation test\n");
+
+    tlsf_epoch_init(&epoch, t, &epoch_lock);
+    tlsf_epoch_slot_t *r = tlsf_epoch_register(&epoch);
+    tlsf_epoch_slot_t *w = tlsf_epoch_register(&epoch);
+    assert(r && w && r != w);
+
+    /* A reader holds back what is retired during its section, but not what
+     * is retired before it enters the next one.
+     */
+    tlsf_epoch_enter(&epoch, r);
+    tlsf_epoch_retire(&epoch, w, epoch_node(t));
+    assert(!tlsf_epoch_reclaim(&epoch, w));
+    tlsf_epoch_retire(&epoch, w, epoch_node(t));
+    assert(!tlsf_epoch_reclaim(&epoch, w));
+    tlsf_epoch_exit(&epoch, r);
+    tlsf_epoch_enter(&epoch, r);
+    assert(tlsf_epoch_reclaim(&epoch, w) == 2);
+    tlsf_epoch_exit(&epoch, r);
+
+    /* Without readers, full batches are freed as they are retired. */
+    for (unsigned i = 0; i < 1000; i++)
+        tlsf_epoch_retire(&epoch, w, epoch_node(t));
+    size_t left = tlsf_epoch_reclaim(&epoch, w);
+    assert(left && left < 100);
+    assert(!tlsf_epoch_reclaim(&epoch, w));
+    tlsf_check(t);
+
+    /* Threads come and go, many more than there are slots. Each exiting one
+     * leaves its slot to the next, and its block to the domain until the
+     * reader is done.
+     */
+    tlsf_epoch_enter(&epoch, r);
+    void *slot = NULL;
+    for (unsigned i = 0; i < 3 * TLSF_EPOCH_MAX_THREADS; i++) {
+        pthread_t thread;
+        void *ret;
+        assert(!pthread_create(&thread, NULL, epoch_churn, t));
+        assert(!pthread_join(thread, &ret));
+        assert(!slot || ret == slot);
+        slot = ret;
+    }
+    assert(!tlsf_epoch_reclaim(&epoch, w));
+    tlsf_epoch_exit(&epoch, r);
+    assert(tlsf_epoch_reclaim(&epoch, w) == 3 * TLSF_EPOCH_MAX_THREADS);
+    tlsf_check(t);
+
+    /* Replace the shared block while other threads keep reading it. */
+    epoch_shared = epoch_node(t);
+    pthread_t threads[4];
+    for (unsigned i = 0; i < ARRAY_SIZE(threads); i++)
+        assert(!pthread_create(&threads[i], NULL, epoch_reader, NULL));
+    for (unsigned i = 0; i < 100000; i++) {
+        size_t *old = __atomic_exchange_n(&epoch_shared, epoch_node(t),
+                                          __ATOMIC_ACQ_REL);
+        tlsf_epoch_retire(&epoch, w, old);
+    }
+    __atomic_store_n(&epoch_done, true, __ATOMIC_RELEASE);
+    for (unsigned i = 0; i < ARRAY_SIZE(threads); i++)
+        pthread_join(threads[i], NULL);
+
+    tlsf_epoch_retire(&epoch, w, epoch_shared);
+    tlsf_epoch_destroy(&epoch);
+    tlsf_check(t);
+    assert(!t->size);
+}
+
+#ifdef TLSF_ENABLE_TRACE
+/* Count the events of @heap recorded after event number @after. */
+static unsigned trace_count(const tlsf_t *heap, uint64_t after, uint32_t event)
+{
+    tlsf_trace_t ev[TLSF_TRACE_EVENTS];
+    size_t n = tlsf_trace_snapshot(ev, ARRAY_SIZE(ev));
+    unsigned count = 0;
+    for (size_t i = 0; i < n; i++) {
+        assert(!i || (ev[i].seq > ev[i - 1].seq &&
+                      ev[i].time >= ev[i - 1].time));
+        if (ev[i].seq > after && ev[i].heap == heap && ev[i].event == event)
+            count++;
+    }
+    return count;
+}
+
+static void trace_test(tlsf_t *t)
+{
+    printf("Tracepoint test\n");
+
+    tlsf_trace_t last;
+    uint64_t start = tlsf_trace_snapshot(&last, 1) ? last.seq : 0;
+
+    void *a = tlsf_malloc(t, 1000);
+    void *b = tlsf_malloc(t, 1000);
+    assert(a && b && trace_count(t, start, TLSF_TRACE_GROW) == 2);
+    void *c = tlsf_realloc(t, a, 5000);
+    assert(c && c != a);
+    assert(trace_count(t, start, TLSF_TRACE_RELOCATE) == 1);
+    assert(tlsf_trace_snapshot(&last, 1) == 1);
+    assert(last.event == TLSF_TRACE_RELOCATE && last.addr == c &&
+           last.arg == (size_t) a && last.size >= 5000);
+    tlsf_free(t, b);
+    tlsf_free(t, c);
+    assert(trace_count(t, start, TLSF_TRACE_SHRINK) >= 1);
+    assert(!t->size);
+
+    /* The NUMA arenas record failures, each arena once. */
+    assert(!tlsf_numa_init(&numa, 1 << 20));
+    assert(!tlsf_numa_malloc(&numa, 2 << 20));
+    assert(trace_count(&numa.arena[0].tlsf, start, TLSF_TRACE_FAIL) == 1);
+    tlsf_numa_destroy(&numa);
+
+    /* Only the most recent events are kept. */
+    for (unsigned i = 0; i < TLSF_TRACE_EVENTS; i++)
+        tlsf_free(t, tlsf_malloc(t, 1));
+    assert(!trace_count(t, start, TLSF_TRACE_RELOCATE));
+}
+#endif
+
+#ifdef TLSF_ENABLE_PAGES
+static void pages_test(tlsf_t *t)
+{
+    printf("Page allocation test\n");
+
+    assert(!tlsf_pages_init(t, 64 * PAGE, 4 * PAGE));
+
+    /* Large blocks are whole pages outside of the arena. */
+    char *p = (char *) tlsf_aalloc(t, PAGE, 16 * PAGE);
+    char *q = (char *) tlsf_malloc(t, 5 * PAGE - 100);
+    assert(p && q && !t->size);
+    assert(!((size_t) p % PAGE) && !((size_t) q % PAGE));
+    assert(q >= p + 16 * PAGE || q + 5 * PAGE <= p);
+    memset(p, 1, 16 * PAGE);
+    memset(q, 2, 5 * PAGE);
+    char *small = (char *) tlsf_malloc(t, 100);
+    assert(small && t->size);
+    assert(tlsf_try_expand(t, p, 16 * PAGE) == p);
+    assert(!tlsf_try_expand(t, p, 16 * PAGE + 1));
+
+    /* Pages are kept while more than half of them are used. */
+    assert(tlsf_realloc(t, q, 5 * PAGE) == q);
+    assert(tlsf_realloc(t, q, 3 * PAGE) == q);
+    char *r = (char *) tlsf_realloc(t, q, 100);
+    assert(r && (r < p || r >= p + 16 * PAGE));
+    for (unsigned i = 0; i < 100; i++)
+        assert(r[i] == 2);
+    tlsf_free(t, r);
+    tlsf_free(t, small);
+    assert(!t->size);
+
+    /* Freed runs coalesce, so the whole region can be allocated again. */
+    tlsf_free(t, p);
+    assert((p = (char *) tlsf_malloc(t, 64 * PAGE)));
+    assert(!t->size);
+    tlsf_reset(t);
+    assert((q = (char *) tlsf_malloc(t, 64 * PAGE)) == p);
+
+    /* Once the region is full, the arena takes over. */
+    assert((r = (char *) tlsf_malloc(t, 4 * PAGE)) && t->size);
+    tlsf_free(t, r);
+    tlsf_free(t, q);
+    assert(!t->size);
+    tlsf_pages_destroy(t);
+}
+#endif
+
+#ifdef TLSF_ENABLE_INDEX
+/* Check that every byte of the block at @p maps to it, and that the bytes
+ * right behind it do not.
+ */
+static void index_check(tlsf_t *t, char *p, size_t len)
+{
+    size_t size;
+    assert(tlsf_find_block(t, p, &size) == p && size >= len);
+    for (size_t i = 0; i < size; i += 1 + i / 2)
+        assert(tlsf_find_block(t, p + i, NULL) == p);
+    assert(tlsf_find_block(t, p + size - 1, NULL) == p);
+    assert(tlsf_find_block(t, p + size, NULL) != p);
+}
+
+static void index_test(tlsf_t *t)
+{
+    printf("Interior pointer test\n");
+
+    assert(!t->size && !tlsf_index_init(t, (size_t) 1 << 30));
+    char *p[300];
+    size_t len[ARRAY_SIZE(p)];
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++) {
+        len[i] = i % 3 ? (size_t) rand() % 5000 + 1 : 256 * (i % 7 + 1);
+        p[i] = (char *) (i % 3 ? tlsf_malloc(t, len[i])
+                               : tlsf_aalloc(t, 256, len[i]));
+        assert(p[i]);
+    }
+    /* Both checks cover the index, the budget covers the whole heap. */
+    assert(tlsf_check_step(t, 1000));
+    tlsf_check(t);
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i += 2)
+        tlsf_free(t, p[i]);
+    for (unsigned i = 0; i < ARRAY_SIZE(p); i++) {
+        if (i % 2)
+            index_check(t, p[i], len[i]);
+        else
+            assert(!tlsf_find_block(t, p[i], NULL));
+    }
+    assert(tlsf_check_step(t, 1000));
+    tlsf_check(t);
+
+    /* Moved blocks are found at their new address only. */
+    char *q = (char *) tlsf_realloc(t, p[1], 100000);
+    assert(q && q != p[1] && !tlsf_find_block(t, p[1], NULL));
+    index_check(t, q, 100000);
+    p[1] = q;
+    assert(tlsf_check_step(t, 1000));
+    tlsf_check(t);
+
+    /* Blocks released to a mark are gone from the index. Holes below the
+     * mark are too small for this one.
+     */
+    size_t mark;
+    assert(tlsf_mark(t, &mark));
+    assert((q = (char *) tlsf_malloc(t, 1 << 20)));
+    index_check(t, q, 1 << 20);
+    tlsf_release(t, mark);
+    assert(!tlsf_find_block(t, q, NULL));
+    assert(tlsf_check_step(t, 1000));
+    tlsf_check(t);
+
+    /* Addresses outside the arena belong to no block, and the arena cannot
+     * grow beyond the index.
+     */
+    assert(!tlsf_find_block(t, &mark, NULL));
+    assert(!tlsf_find_block(t, NULL, NULL));
+    assert(!tlsf_malloc(t, (size_t) 1 << 30));
+
+    for (unsigned i = 1; i < ARRAY_SIZE(p); i += 2)
+        tlsf_free(t, p[i]);
+    assert(!t->size);
+
+    /* Compaction moves the marks along with the blocks. */
+    tlsf_handle_t slots[64], *h[ARRAY_SIZE(slots)];
+    tlsf_handles_t table;
+    tlsf_handles_init(&table, slots, ARRAY_SIZE(slots));
+    for (unsigned i = 0; i < ARRAY_SIZE(h); i++)
+        assert((h[i] = tlsf_halloc(t, &table, 100 + i)));
+    for (unsigned i = 0; i < ARRAY_SIZE(h); i += 2)
+        tlsf_hfree(t, &table, h[i]);
+    char *last = (char *) h[ARRAY_SIZE(h) - 1]->ptr;
+    while (!tlsf_compact(t, &table, 4))
+        assert(tlsf_check_step(t, 1000));
+    assert(h[ARRAY_SIZE(h) - 1]->ptr != last);
+    assert(tlsf_check_step(t, 1000));
+    tlsf_check(t);
+    for (unsigned i = 1; i < ARRAY_SIZE(h); i += 2) {
+        /* The handle refers past the back pointer at the payload. */
+        index_check(t, (char *) ((void **) h[i]->ptr - 1), 100 + i);
+        tlsf_hfree(t, &table, h[i]);
+    }
+    assert(!t->size);
+    tlsf_index_destroy(t);
+}
+#endif
+
+#ifdef TLSF_ENABLE_PIC
+static void persist_test(void)
+{
+    printf("Persistent heap test\n");
+
+    const size_t map_size = 1 << 20;
+    FILE *file = tmpfile();
+    assert(file);
+    int fd = fileno(file);
+    assert(!ftruncate(fd, (off_t) map_size));
+
+    char *a = (char *) mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd, 0);
+    assert(a != MAP_FAILED);
+    persist_capacity = map_size - PERSIST_ARENA;
+    persist_heap = tlsf_attach(a, persist_resize, &persist_capacity);
+    assert(persist_heap == (tlsf_t *) a);
+
+    /* Only offsets survive a remap, so remember those. */
+    size_t off[64];
+    for (unsigned i = 0; i < ARRAY_SIZE(off); i++) {
+        char *p = (char *) tlsf_malloc(persist_heap, 100 + i * 37);
+        assert(p);
+        memset(p, (int) i, 100 + i * 37);
+        off[i] = (size_t) (p - a);
+    }
+    for (unsigned i = 1; i < ARRAY_SIZE(off); i += 2) {
+        tlsf_free(persist_heap, a + off[i]);
+        off[i] = 0;
+    }
+    tlsf_check(persist_heap);
+
+    /* Map the file again at another address and drop the first mapping. */
+    char *b = (char *) mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd, 0);
+    assert(b != MAP_FAILED && b != a);
+    munmap(a, map_size);
+    persist_heap = tlsf_attach(b, persist_resize, &persist_capacity);
+    assert(persist_heap == (tlsf_t *) b);
+    tlsf_check(persist_heap);
+    assert(tlsf_check_step(persist_heap, 1000));
+
+    for (unsigned i = 0; i < ARRAY_SIZE(off); i++) {
+        if (!off[i])
+            continue;
+        for (size_t j = 0; j < 100 + i * 37; j++)
+            assert(b[off[i] + j] == (char) i);
+        tlsf_free(persist_heap, b + off[i]);
+    }
+    void *p = tlsf_malloc(persist_heap, 4096);
+    assert(p);
+    tlsf_free(persist_heap, p);
+    tlsf_check(persist_heap);
+
+    /* Anything else is rejected. */
+    memset(b, 0xff, sizeof(tlsf_t));
+    assert(!tlsf_attach(b, persist_resize, &persist_capacity));
+
+    persist_heap = NULL;
+    munmap(b, map_size);
+    fclose(file);
+}
+
+/* The other end of shared_test(), run in a freshly exec'd copy of the test,
+ * so that its code is mapped at another address if the binary is a PIE.
+ * Answers the message at @msg_off in the segment of @fd.
+ */
+static int shared_peer(const char *fd_arg, const char *msg_arg)
+{
+    const size_t seg_size = 1 << 20;
+    int fd = (int) strtol(fd_arg, NULL, 0);
+    size_t msg_off = (size_t) strtoull(msg_arg, NULL, 0);
+
+    char *b = (char *) mmap(0, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd, 0);
+    shared_heap = b != MAP_FAILED ? tlsf_shared_attach(b) : NULL;
+    if (!shared_heap)
+        return 1;
+    char *in = (char *) tlsf_shared_ptr(shared_heap, msg_off);
+    char *reply = (char *) tlsf_shared_malloc(shared_heap, 512);
+    if (strcmp(in, "ping") || !reply)
+        return 2;
+    strcpy(reply, "pong");
+    size_t reply_off = tlsf_shared_offset(shared_heap, reply);
+    memcpy(in, &reply_off, sizeof(reply_off));
+
+    /* The backend of this process is not left behind in the segment. */
+    if (shared_heap->tlsf.resize)
+        return 3;
+
+    /* Die while holding the lock. */
+    pthread_mutex_lock(&shared_heap->lock);
+    _exit(0);
+}
+
+static void shared_test(void)
+{
+    printf("Shared heap test\n");
+
+    const size_t seg_size = 1 << 20;
+    FILE *file = tmpfile();
+    assert(file);
+    int fd = fileno(file);
+    assert(!ftruncate(fd, (off_t) seg_size));
+
+    char *a = (char *) mmap(0, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            fd, 0);
+    assert(a != MAP_FAILED);
+    shared_heap = tlsf_shared_init(a, seg_size);
+    assert(shared_heap);
+
+    char *msg = (char *) tlsf_shared_malloc(shared_heap, 256);
+    assert(msg);
+    strcpy(msg, "ping");
+    size_t msg_off = tlsf_shared_offset(shared_heap, msg);
+
+    /* The peer grows the arena, which this process then shrinks again. */
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (!pid) {
+        char fd_arg[16], msg_arg[32];
+        snprintf(fd_arg, sizeof(fd_arg), "%d", fd);
+        snprintf(msg_arg, sizeof(msg_arg), "%zu", msg_off);
+        execl("/proc/self/exe", "test", "shared-peer", fd_arg, msg_arg,
+              (char *) NULL);
+        _exit(127);
+    }
+
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && !WEXITSTATUS(status));
+
+    /* The lock is recovered, since the heap was left consistent. */
+    size_t reply_off;
+    memcpy(&reply_off, msg, sizeof(reply_off));
+    char *reply = (char *) tlsf_shared_ptr(shared_heap, reply_off);
+    assert(!strcmp(reply, "pong"));
+    tlsf_shared_free(shared_heap, reply);
+    tlsf_shared_free(shared_heap, msg);
+    tlsf_shared_check(shared_heap);
+    assert(!shared_heap->tlsf.size);
+
+    shared_heap = NULL;
+    munmap(a, seg_size);
+    fclose(file);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+#ifdef TLSF_ENABLE_PIC
+    if (argc == 4 && !strcmp(argv[1], "shared-peer"))
+        return shared_peer(argv[2], argv[3]);
+#else
+    (void) argc;
+    (void) argv;
+#endif
     PAGE = (size_t) sysconf(_SC_PAGESIZE);
     MAX_PAGES = 20 * TLSF_MAX_SIZE / PAGE;
     tlsf_t t = TLSF_INIT;
@@ -212,7 +1451,40 @@ int main(void)
     large_size_test(&t);
     random_sizes_test(&t);
 
-    /* Run pool append test */
+    check_step_test(&t);
+    in_place_test(&t);
+    compact_test(&t);
+    compact_end_test();
+    reset_test(&t);
+    sub_heap_test(&t);
+    policy_test(&t);
+    order_test(&t);
+    reserve_test(&t);
+    lifetime_test(&t);
+#ifdef TLSF_ENABLE_TAGS
+    tag_test(&t);
+#endif
+#ifdef TLSF_ENABLE_PROFILE
+    prof_test(&t);
+#endif
+    numa_test();
+    mt_test();
+    epoch_test(&t);
+#ifdef TLSF_ENABLE_TRACE
+    trace_test(&t);
+#endif
+#ifdef TLSF_ENABLE_PAGES
+    pages_test(&t);
+#endif
+#ifdef TLSF_ENABLE_INDEX
+    index_test(&t);
+#endif
+
+#ifdef TLSF_ENABLE_PIC
+    persist_test();
+    shared_test();
+#endif
+
     append_pool_test(&t);
 
     puts("OK!");
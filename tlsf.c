@@ -9,25 +9,24 @@
 #include <string.h>
 
 #include "tlsf.h"
+#include "tlsf_internal.h"
 
 #ifndef UNLIKELY
 #define UNLIKELY(x) __builtin_expect(!!(x), false)
 #endif
 
 /* All allocation sizes and addresses are aligned. */
+#define ALIGN_SHIFT _TLSF_ALIGN_SHIFT
 #define ALIGN_SIZE ((size_t) 1 << ALIGN_SHIFT)
-#if __SIZE_WIDTH__ == 64
-#define ALIGN_SHIFT 3
-#else
-#define ALIGN_SHIFT 2
-#endif
 
-/* First level (FL) and second level (SL) counts */
-#define SL_SHIFT 4
+/* First level (FL) and second level (SL) counts, configured in tlsf.h */
+#define SL_SHIFT TLSF_SL_SHIFT
 #define SL_COUNT (1U << SL_SHIFT)
-#define FL_MAX _TLSF_FL_MAX
+#define SL_BIT(sl) ((tlsf_sl_map_t) 1 << (sl))
+#define FL_MAX TLSF_FL_MAX
 #define FL_SHIFT (SL_SHIFT + ALIGN_SHIFT)
 #define FL_COUNT (FL_MAX - FL_SHIFT + 1)
+#define FL_BIT(fl) ((tlsf_fl_map_t) 1 << (fl))
 
 /* Block status bits are stored in the least significant bits (LSB) of the
  * size field.
@@ -36,6 +35,22 @@
 #define BLOCK_BIT_PREV_FREE ((size_t) 2)
 #define BLOCK_BITS (BLOCK_BIT_FREE | BLOCK_BIT_PREV_FREE)
 
+/* Per-block metadata of used blocks is stored in the most significant bits
+ * (MSB) of the size field, far above any block size.
+ */
+#ifdef TLSF_ENABLE_TAGS
+#define BLOCK_TAG_SHIFT (__SIZE_WIDTH__ - 8)
+#define BLOCK_TAG_MASK ((size_t) (TLSF_TAG_COUNT - 1) << BLOCK_TAG_SHIFT)
+#else
+#define BLOCK_TAG_MASK ((size_t) 0)
+#endif
+#ifdef TLSF_ENABLE_PROFILE
+#define BLOCK_BIT_SAMPLED ((size_t) 1 << (__SIZE_WIDTH__ - 1))
+#else
+#define BLOCK_BIT_SAMPLED ((size_t) 0)
+#endif
+#define BLOCK_META (BLOCK_TAG_MASK | BLOCK_BIT_SAMPLED)
+
 /* A free block must be large enough to store its header minus the size of the
  * prev field.
  */
@@ -44,6 +59,11 @@
 #define BLOCK_SIZE_MAX ((size_t) 1 << (FL_MAX - 1))
 #define BLOCK_SIZE_SMALL ((size_t) 1 << FL_SHIFT)
 
+/* Longest walk of a free list for an address-ordered insertion, or for the
+ * lowest or highest block of a bin (lifetime hints)
+ */
+#define ORDER_WALK 16
+
 #ifndef ASSERT
 #ifdef TLSF_ENABLE_ASSERT
 #include <assert.h>
@@ -57,12 +77,38 @@
 #define INLINE static inline __attribute__((always_inline))
 #endif
 
+/* Tracepoints on the slow paths. Each is a USDT probe (provider "tlsf") if
+ * <sys/sdt.h> is available and is also recorded in the event ring. Without
+ * TLSF_ENABLE_TRACE the arguments are not even evaluated.
+ */
+#ifdef TLSF_ENABLE_TRACE
+#include <time.h>
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifdef DTRACE_PROBE4
+#define TRACE_USDT(event, t, addr, size, arg) \
+    DTRACE_PROBE4(tlsf, event, t, addr, size, arg)
+#else
+#define TRACE_USDT(event, t, addr, size, arg) ((void) 0)
+#endif
+#define TRACE(event, t, addr, size, arg)                                  \
+    do {                                                                  \
+        TRACE_USDT(event, t, addr, size, arg);                            \
+        trace_record(TLSF_TRACE_##event, t, addr, size, (size_t) (arg)); \
+    } while (0)
+#else
+#define TRACE(event, t, addr, size, arg) ((void) 0)
+#endif
+
 typedef struct tlsf_block {
     /* Points to the previous block.
      * This field is only valid if the previous block is free and is actually
      * stored at the end of the previous block.
      */
-    struct tlsf_block *prev;
+    tlsf_link_t prev;
 
     /* Size and block bits */
     size_t header;
@@ -70,7 +116,7 @@ typedef struct tlsf_block {
     /* Next and previous free blocks.
      * These fields are only valid if the corresponding block is free.
      */
-    struct tlsf_block *next_free, *prev_free;
+    tlsf_link_t next_free, prev_free;
 } tlsf_block_t;
 
 _Static_assert(sizeof(size_t) == 4 || sizeof(size_t) == 8,
@@ -80,19 +126,42 @@ _Static_assert(sizeof(size_t) == sizeof(void *),
 _Static_assert(ALIGN_SIZE == BLOCK_SIZE_SMALL / SL_COUNT,
                "sizes are not properly set");
 _Static_assert(BLOCK_SIZE_MIN < BLOCK_SIZE_SMALL,
-               "min allocation size is wrong");
+               "min allocation size is wrong, increase TLSF_SL_SHIFT");
+_Static_assert(FL_MAX < __SIZE_WIDTH__, "TLSF_FL_MAX too large");
 _Static_assert(BLOCK_SIZE_MAX == TLSF_MAX_SIZE + BLOCK_OVERHEAD,
                "max allocation size is wrong");
-_Static_assert(FL_COUNT <= 32, "index too large");
-_Static_assert(SL_COUNT <= 32, "index too large");
+_Static_assert(FL_COUNT <= 64, "index too large, reduce TLSF_FL_MAX");
+#ifdef TLSF_ENABLE_TAGS
+_Static_assert(TLSF_TAG_COUNT && TLSF_TAG_COUNT <= 256 &&
+                   !(TLSF_TAG_COUNT & (TLSF_TAG_COUNT - 1)),
+               "tag count must be a power of two up to 256");
+_Static_assert(BLOCK_SIZE_MAX < (size_t) 1 << BLOCK_TAG_SHIFT,
+               "tags overlap the block size");
+#endif
+_Static_assert(!(BLOCK_TAG_MASK & BLOCK_BIT_SAMPLED),
+               "tags overlap the sampled bit, reduce TLSF_TAG_COUNT");
+_Static_assert(SL_COUNT <= 64, "index too large, reduce TLSF_SL_SHIFT");
 _Static_assert(FL_COUNT == _TLSF_FL_COUNT, "invalid level configuration");
 _Static_assert(SL_COUNT == _TLSF_SL_COUNT, "invalid level configuration");
 
-INLINE uint32_t bitmap_ffs(uint32_t x)
+INLINE uint32_t fl_map_ffs(tlsf_fl_map_t x)
+{
+    ASSERT(x, "no set bit found");
+#if FL_COUNT > 32
+    return (uint32_t) __builtin_ctzll(x);
+#else
+    return (uint32_t) __builtin_ctz(x);
+#endif
+}
+
+INLINE uint32_t sl_map_ffs(tlsf_sl_map_t x)
 {
-    uint32_t i = (uint32_t) __builtin_ffs((int32_t) x);
-    ASSERT(i, "no set bit found");
-    return i - 1U;
+    ASSERT(x, "no set bit found");
+#if SL_COUNT > 32
+    return (uint32_t) __builtin_ctzll(x);
+#else
+    return (uint32_t) __builtin_ctz(x);
+#endif
 }
 
 INLINE uint32_t log2floor(size_t x)
@@ -105,15 +174,43 @@ INLINE uint32_t log2floor(size_t x)
 #endif
 }
 
+#ifdef TLSF_ENABLE_PIC
+/* Links are stored as offsets from the structure holding them, so that they
+ * stay valid wherever the heap is mapped. Zero encodes a null link, since
+ * nothing links to itself.
+ */
+INLINE tlsf_block_t *link_get(const void *base, tlsf_link_t link)
+{
+    return link ? (tlsf_block_t *) ((uintptr_t) base + link) : NULL;
+}
+
+INLINE tlsf_link_t link_make(const void *base, tlsf_block_t *block)
+{
+    return block ? (uintptr_t) block - (uintptr_t) base : 0;
+}
+#else
+INLINE tlsf_block_t *link_get(const void *base, tlsf_link_t link)
+{
+    (void) base;
+    return link;
+}
+
+INLINE tlsf_link_t link_make(const void *base, tlsf_block_t *block)
+{
+    (void) base;
+    return block;
+}
+#endif
+
 INLINE size_t block_size(const tlsf_block_t *block)
 {
-    return block->header & ~BLOCK_BITS;
+    return block->header & ~(BLOCK_BITS | BLOCK_META);
 }
 
 INLINE void block_set_size(tlsf_block_t *block, size_t size)
 {
     ASSERT(!(size % ALIGN_SIZE), "invalid size");
-    block->header = size | (block->header & BLOCK_BITS);
+    block->header = size | (block->header & (BLOCK_BITS | BLOCK_META));
 }
 
 INLINE bool block_is_free(const tlsf_block_t *block)
@@ -166,7 +263,7 @@ INLINE tlsf_block_t *block_from_payload(void *ptr)
 INLINE tlsf_block_t *block_prev(const tlsf_block_t *block)
 {
     ASSERT(block_is_prev_free(block), "previous block must be free");
-    return block->prev;
+    return link_get(block, block->prev);
 }
 
 /* Return location of next existing block. */
@@ -182,7 +279,7 @@ INLINE tlsf_block_t *block_next(tlsf_block_t *block)
 INLINE tlsf_block_t *block_link_next(tlsf_block_t *block)
 {
     tlsf_block_t *next = block_next(block);
-    next->prev = block;
+    next->prev = link_make(next, block);
     return next;
 }
 
@@ -207,11 +304,15 @@ INLINE size_t adjust_size(size_t size, size_t align)
     return size < BLOCK_SIZE_MIN ? BLOCK_SIZE_MIN : size;
 }
 
-/* Round up to the next block size */
+/* Round up to the next block size. Small sizes have a list each, and their
+ * log2 may be below SL_SHIFT.
+ */
 INLINE size_t round_block_size(size_t size)
 {
+    if (size < BLOCK_SIZE_SMALL)
+        return size;
     size_t t = ((size_t) 1 << (log2floor(size) - SL_SHIFT)) - 1;
-    return size >= BLOCK_SIZE_SMALL ? (size + t) & ~t : size;
+    return (size + t) & ~t;
 }
 
 INLINE void mapping(size_t size, uint32_t *fl, uint32_t *sl)
@@ -245,26 +346,27 @@ INLINE tlsf_block_t *block_find_suitable(tlsf_t *t, uint32_t *fl, uint32_t *sl)
     ASSERT(*sl < SL_COUNT, "wrong second level");
 
     /* Search for a block in the list associated with the given fl/sl index. */
-    uint32_t sl_map = t->sl[*fl] & (~0U << *sl);
+    tlsf_sl_map_t sl_map = t->sl[*fl] & (~(tlsf_sl_map_t) 0 << *sl);
     if (!sl_map) {
         /* No block exists. Search in the next largest first-level list. */
-        uint32_t fl_map = t->fl & ((*fl + 1 >= 32) ? 0U : (~0U << (*fl + 1)));
+        tlsf_fl_map_t fl_map =
+            *fl + 1 >= FL_COUNT ? 0 : t->fl & (~(tlsf_fl_map_t) 0 << (*fl + 1));
 
         /* No free blocks available, memory has been exhausted. */
         if (UNLIKELY(!fl_map))
             return NULL;
 
-        *fl = bitmap_ffs(fl_map);
+        *fl = fl_map_ffs(fl_map);
         ASSERT(*fl < FL_COUNT, "wrong first level");
 
         sl_map = t->sl[*fl];
         ASSERT(sl_map, "second level bitmap is null");
     }
 
-    *sl = bitmap_ffs(sl_map);
+    *sl = sl_map_ffs(sl_map);
     ASSERT(*sl < SL_COUNT, "wrong second level");
 
-    return t->block[*fl][*sl];
+    return link_get(t, t->block[*fl][*sl]);
 }
 
 /* Remove a free block from the free list. */
@@ -276,43 +378,65 @@ INLINE void remove_free_block(tlsf_t *t,
     ASSERT(fl < FL_COUNT, "wrong first level");
     ASSERT(sl < SL_COUNT, "wrong second level");
 
-    tlsf_block_t *prev = block->prev_free;
-    tlsf_block_t *next = block->next_free;
+    tlsf_block_t *prev = link_get(block, block->prev_free);
+    tlsf_block_t *next = link_get(block, block->next_free);
     if (next)
-        next->prev_free = prev;
+        next->prev_free = link_make(next, prev);
     if (prev)
-        prev->next_free = next;
+        prev->next_free = link_make(prev, next);
 
     /* If this block is the head of the free list, set new head. */
-    if (t->block[fl][sl] == block) {
-        t->block[fl][sl] = next;
+    if (link_get(t, t->block[fl][sl]) == block) {
+        t->block[fl][sl] = link_make(t, next);
 
         /* If the new head is null, clear the bitmap. */
         if (!next) {
-            t->sl[fl] &= ~(1U << sl);
+            t->sl[fl] &= ~SL_BIT(sl);
 
             /* If the second bitmap is now empty, clear the fl bitmap. */
             if (!t->sl[fl])
-                t->fl &= ~(1U << fl);
+                t->fl &= ~FL_BIT(fl);
         }
     }
 }
 
+/* Insert a free block after @head, in address order within at most
+ * ORDER_WALK steps. Beyond that, the list is left partially ordered.
+ */
+static void insert_ordered(tlsf_block_t *block, tlsf_block_t *head)
+{
+    tlsf_block_t *prev = head, *next = link_get(head, head->next_free);
+    for (unsigned i = 1; next && next < block && i < ORDER_WALK; i++) {
+        prev = next;
+        next = link_get(next, next->next_free);
+    }
+    block->prev_free = link_make(block, prev);
+    block->next_free = link_make(block, next);
+    prev->next_free = link_make(prev, block);
+    if (next)
+        next->prev_free = link_make(next, block);
+}
+
 /* Insert a free block into the free block list and mark the bitmaps. */
 INLINE void insert_free_block(tlsf_t *t,
                               tlsf_block_t *block,
                               uint32_t fl,
                               uint32_t sl)
 {
-    tlsf_block_t *current = t->block[fl][sl];
+    tlsf_block_t *current = link_get(t, t->block[fl][sl]);
     ASSERT(block, "cannot insert a null entry into the free list");
-    block->next_free = current;
-    block->prev_free = 0;
-    if (current)
-        current->prev_free = block;
-    t->block[fl][sl] = block;
-    t->fl |= 1U << fl;
-    t->sl[fl] |= 1U << sl;
+    if (UNLIKELY(t->order_min) && current && current < block &&
+        mapping_size(fl, sl) >= t->order_min) {
+        insert_ordered(block, current);
+    } else {
+        block->next_free = link_make(block, current);
+        block->prev_free = link_make(block, NULL);
+        if (current)
+            current->prev_free = link_make(current, block);
+        t->block[fl][sl] = link_make(t, block);
+    }
+    t->fl |= FL_BIT(fl);
+    t->sl[fl] |= SL_BIT(sl);
 }
 
 /* Remove a given block from the free list. */
@@ -356,6 +480,17 @@ INLINE tlsf_block_t *block_absorb(tlsf_block_t *prev, tlsf_block_t *block)
     return prev;
 }
 
+/* Keep the cursors of tlsf_check_step() and tlsf_compact() on live headers
+ * when the block they point to is absorbed into its predecessor.
+ */
+INLINE void cursor_absorb(tlsf_t *t, tlsf_block_t *prev, tlsf_block_t *block)
+{
+    if (UNLIKELY(link_get(t, t->check_block) == block))
+        t->check_block = link_make(t, prev);
+    if (UNLIKELY(link_get(t, t->compact_block) == block))
+        t->compact_block = link_make(t, prev);
+}
+
 /* Merge a just-freed block with an adjacent previous free block. */
 INLINE tlsf_block_t *block_merge_prev(tlsf_t *t, tlsf_block_t *block)
 {
@@ -365,6 +500,7 @@ INLINE tlsf_block_t *block_merge_prev(tlsf_t *t, tlsf_block_t *block)
         ASSERT(block_is_free(prev),
                "prev block is not free though marked as such");
         block_remove(t, prev);
+        cursor_absorb(t, prev, block);
         block = block_absorb(prev, block);
     }
     return block;
@@ -378,6 +514,7 @@ INLINE tlsf_block_t *block_merge_next(tlsf_t *t, tlsf_block_t *block)
     if (block_is_free(next)) {
         ASSERT(block_size(block), "previous block can't be last");
         block_remove(t, next);
+        cursor_absorb(t, block, next);
         block = block_absorb(block, next);
     }
     return block;
@@ -420,13 +557,258 @@ INLINE tlsf_block_t *block_ltrim_free(tlsf_t *t,
     return rest;
 }
 
+/* Split the last @size bytes off a free block into a block of their own,
+ * and return the first part to the pool.
+ */
+INLINE tlsf_block_t *block_carve_high(tlsf_t *t,
+                                      tlsf_block_t *block,
+                                      size_t size)
+{
+    ASSERT(block_is_free(block), "block must be free");
+    ASSERT(block_can_split(block, size), "block is too small");
+    tlsf_block_t *rest =
+        block_split(block, block_size(block) - size - BLOCK_OVERHEAD);
+    block_set_prev_free(rest, true);
+    block_link_next(block);
+    block_insert(t, block);
+    return rest;
+}
+
+/* Account a used block to its tag, see tlsf_malloc_tagged(). */
+INLINE void tag_alloc(tlsf_t *t, tlsf_block_t *block)
+{
+#ifdef TLSF_ENABLE_TAGS
+    tlsf_tag_stat_t *stat =
+        &t->tags[(block->header & BLOCK_TAG_MASK) >> BLOCK_TAG_SHIFT];
+    stat->bytes += block_size(block);
+    stat->count++;
+#else
+    (void) t;
+    (void) block;
+#endif
+}
+
+INLINE void tag_release(tlsf_t *t, tlsf_block_t *block)
+{
+#ifdef TLSF_ENABLE_TAGS
+    tlsf_tag_stat_t *stat =
+        &t->tags[(block->header & BLOCK_TAG_MASK) >> BLOCK_TAG_SHIFT];
+    stat->bytes -= block_size(block);
+    stat->count--;
+#else
+    (void) t;
+    (void) block;
+#endif
+}
+
+/* Move the tag of a used block to another one on relocation. */
+INLINE void block_copy_tag(tlsf_t *t, tlsf_block_t *dst, tlsf_block_t *src)
+{
+    if (BLOCK_TAG_MASK) {
+        tag_release(t, dst);
+        dst->header = (dst->header & ~BLOCK_TAG_MASK) |
+                      (src->header & BLOCK_TAG_MASK);
+        tag_alloc(t, dst);
+    }
+}
+
+/* Sampling profiler fast path: a single countdown of allocated bytes. */
+INLINE void prof_alloc(tlsf_t *t, tlsf_block_t *block, size_t size)
+{
+#ifdef TLSF_ENABLE_PROFILE
+    if (UNLIKELY((t->prof_countdown -= (ptrdiff_t) size) < 0) &&
+        tlsf_prof_sample(t, block_payload(block), size))
+        block->header |= BLOCK_BIT_SAMPLED;
+#else
+    (void) t;
+    (void) block;
+    (void) size;
+#endif
+}
+
+INLINE void prof_release(tlsf_t *t, tlsf_block_t *block)
+{
+#ifdef TLSF_ENABLE_PROFILE
+    if (UNLIKELY(block->header & BLOCK_BIT_SAMPLED))
+        tlsf_prof_release(t, block_payload(block));
+#else
+    (void) t;
+    (void) block;
+#endif
+}
+
+/* Keep the interior-pointer index in step with the used blocks. */
+INLINE void index_set(tlsf_t *t, tlsf_block_t *block)
+{
+#ifdef TLSF_ENABLE_INDEX
+    if (UNLIKELY(t->index != NULL))
+        tlsf_index_set(t, block_payload(block));
+#else
+    (void) t;
+    (void) block;
+#endif
+}
+
+INLINE void index_clear(tlsf_t *t, tlsf_block_t *block)
+{
+#ifdef TLSF_ENABLE_INDEX
+    if (UNLIKELY(t->index != NULL))
+        tlsf_index_clear(t, block_payload(block));
+#else
+    (void) t;
+    (void) block;
+#endif
+}
+
+/* Size of the page allocation at @mem, 0 for blocks of the arena. */
+INLINE size_t page_run(const tlsf_t *t, const void *mem)
+{
+#ifdef TLSF_ENABLE_PAGES
+    return UNLIKELY(t->pages != NULL) ? tlsf_pages_size(t, mem) : 0;
+#else
+    (void) t;
+    (void) mem;
+    return 0;
+#endif
+}
+
+/* Serve large requests from the page allocator, if the heap has one. */
+INLINE void *page_alloc(tlsf_t *t, size_t align, size_t size)
+{
+#ifdef TLSF_ENABLE_PAGES
+    if (UNLIKELY(t->pages != NULL) && size >= t->page_min)
+        return tlsf_pages_alloc(t, align, size);
+#else
+    (void) t;
+    (void) align;
+    (void) size;
+#endif
+    return NULL;
+}
+
+/* Report free memory at the end of the arena below the low watermark. */
+static void low_water_check(tlsf_t *t, tlsf_block_t *block)
+{
+    tlsf_block_t *next = block_next(block);
+    size_t avail = 0;
+    if (block_is_free(next)) {
+        avail = block_size(next);
+        next = block_next(next);
+    }
+    if (!block_size(next) && avail < t->low_water && t->low)
+        t->low(t, avail);
+}
+
 INLINE void *block_use(tlsf_t *t, tlsf_block_t *block, size_t size)
 {
     block_rtrim_free(t, block, size);
     block_set_free(block, false);
+    tag_alloc(t, block);
+    prof_alloc(t, block, size);
+    index_set(t, block);
+    if (UNLIKELY(t->low_water))
+        low_water_check(t, block);
     return block_payload(block);
 }
 
+#ifdef TLSF_ENABLE_TRACE
+_Static_assert(!(TLSF_TRACE_EVENTS & (TLSF_TRACE_EVENTS - 1)),
+               "trace ring size must be a power of two");
+
+static tlsf_trace_t trace_ring[TLSF_TRACE_EVENTS];
+static uint64_t trace_head;
+
+/* Claim a slot with a single atomic increment. Its sequence number is
+ * cleared while the fields are written, so that readers can tell a
+ * complete entry from one being overwritten.
+ */
+static void trace_record(uint32_t event,
+                         const tlsf_t *t,
+                         const void *addr,
+                         size_t size,
+                         size_t arg)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t seq = __atomic_add_fetch(&trace_head, 1, __ATOMIC_RELAXED);
+    tlsf_trace_t *e = &trace_ring[(seq - 1) & (TLSF_TRACE_EVENTS - 1)];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->time,
+                     (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&e->heap, t, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->addr, addr, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->event, event, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, seq, __ATOMIC_RELEASE);
+}
+
+size_t tlsf_trace_snapshot(tlsf_trace_t *out, size_t max)
+{
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TLSF_TRACE_EVENTS ? head - TLSF_TRACE_EVENTS : 0;
+    if (head - first > max)
+        first = head - max;
+
+    size_t n = 0;
+    for (uint64_t seq = first + 1; seq <= head; seq++) {
+        tlsf_trace_t *e = &trace_ring[(seq - 1) & (TLSF_TRACE_EVENTS - 1)];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq)
+            continue;
+        tlsf_trace_t copy = {
+            .seq = seq,
+            .time = __atomic_load_n(&e->time, __ATOMIC_RELAXED),
+            .heap = __atomic_load_n(&e->heap, __ATOMIC_RELAXED),
+            .addr = __atomic_load_n(&e->addr, __ATOMIC_RELAXED),
+            .size = __atomic_load_n(&e->size, __ATOMIC_RELAXED),
+            .arg = __atomic_load_n(&e->arg, __ATOMIC_RELAXED),
+            .event = __atomic_load_n(&e->event, __ATOMIC_RELAXED),
+        };
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq)
+            out[n++] = copy;
+    }
+    return n;
+}
+#endif
+
+/* The default backend is optional when every heap brings its own. */
+extern void *tlsf_resize(tlsf_t *, size_t) __attribute__((weak));
+
+/* A program whose heaps all share one backend may compile tlsf.c with
+ * TLSF_RESIZE naming it, e.g. a static inline function defined before
+ * including tlsf.c, so that the call is inlined.
+ */
+INLINE void *arena_backend(tlsf_t *t, size_t size)
+{
+#ifdef TLSF_RESIZE
+    return TLSF_RESIZE(t, size);
+#else
+    if (t->resize)
+        return t->resize(t, size);
+    return tlsf_resize ? tlsf_resize(t, size) : NULL;
+#endif
+}
+
+/* Resize the arena, or just return its start if @size is unchanged. An
+ * indexed arena cannot outgrow its index and tells it where it is.
+ */
+INLINE void *arena_resize(tlsf_t *t, size_t size)
+{
+#ifdef TLSF_ENABLE_INDEX
+    if (UNLIKELY(t->index != NULL)) {
+        void *base = size <= t->index_max ? arena_backend(t, size) : NULL;
+        if (base)
+            tlsf_index_move(t, base);
+        return base;
+    }
+#endif
+    return arena_backend(t, size);
+}
+
 INLINE void check_sentinel(tlsf_block_t *block)
 {
     (void) block;
@@ -434,130 +816,95 @@ INLINE void check_sentinel(tlsf_block_t *block)
     ASSERT(!block_is_free(block), "sentinel block should not be free");
 }
 
-static bool arena_grow(tlsf_t *t, size_t size)
+/* Growth of an arena of @used bytes for a free block of at least @size bytes,
+ * following the policy in the tlsf_t. Excessive growth is never requested.
+ */
+INLINE size_t arena_grow_size(const tlsf_t *t, size_t used, size_t size)
+{
+    size_t grow = t->size / 100 * t->grow_pct;
+    if (grow < size)
+        grow = size;
+    if (t->grow_step)
+        grow = (used + grow + t->grow_step - 1) / t->grow_step *
+                   t->grow_step -
+               used;
+    grow &= ~(ALIGN_SIZE - 1);
+    return grow > size && grow > TLSF_MAX_SIZE / 2 ? size : grow;
+}
+
+/* Turn the sentinel of the arena at @addr into a free block of @grow bytes,
+ * merged with a free last block, and put a new sentinel behind it. The arena
+ * was @used bytes including its sentinel, or both sentinels if empty, and
+ * must already span @used + @grow.
+ */
+static void arena_extend(tlsf_t *t, char *addr, size_t used, size_t grow)
 {
-    size_t req_size =
-        (t->size ? t->size + BLOCK_OVERHEAD : 2 * BLOCK_OVERHEAD) + size;
-    void *addr = tlsf_resize(t, req_size);
-    if (!addr)
-        return false;
     ASSERT((size_t) addr % ALIGN_SIZE == 0, "wrong heap alignment address");
     tlsf_block_t *block =
-        to_block(t->size ? (char *) addr + t->size - 2 * BLOCK_OVERHEAD
-                         : (char *) addr - BLOCK_OVERHEAD);
+        to_block(t->size ? addr + t->size - 2 * BLOCK_OVERHEAD
+                         : addr - BLOCK_OVERHEAD);
     if (!t->size)
         block->header = 0;
     check_sentinel(block);
-    block->header |= size | BLOCK_BIT_FREE;
+    block->header |= grow | BLOCK_BIT_FREE;
     block = block_merge_prev(t, block);
     block_insert(t, block);
     tlsf_block_t *sentinel = block_link_next(block);
     sentinel->header = BLOCK_BIT_PREV_FREE;
-    t->size = req_size;
+    t->size = used + grow;
     check_sentinel(sentinel);
+}
+
+static bool arena_grow(tlsf_t *t, size_t size)
+{
+    size_t used = t->size ? t->size + BLOCK_OVERHEAD : 2 * BLOCK_OVERHEAD;
+    size_t grow = arena_grow_size(t, used, size);
+    void *addr = arena_resize(t, used + grow);
+    if (!addr && grow > size) {
+        /* Fall back to the exact size before giving up. */
+        grow = size;
+        addr = arena_resize(t, used + grow);
+    }
+    if (!addr)
+        return false;
+    arena_extend(t, (char *) addr, used, grow);
+    TRACE(GROW, t, addr, t->size, grow);
     return true;
 }
 
+/* Extend the arena by memory right behind it. The old sentinel becomes the
+ * header of the new free block, so the arena grows by @size bytes exactly.
+ * The block before the sentinel is only ever reached through its prev link,
+ * which is valid if it is free, so nothing has to be searched.
+ */
 static size_t arena_append_pool(tlsf_t *t, void *mem, size_t size)
 {
-    if (!t->size || !mem || size < 2 * BLOCK_OVERHEAD)
+    if (!t->size || !mem)
         return 0;
 
-    /* Align memory block boundaries */
     char *start = align_ptr((char *) mem, ALIGN_SIZE);
-    char *end = (char *) mem + size;
-    size_t aligned_size = (size_t) (end - start) & ~(ALIGN_SIZE - 1);
-
-    if (aligned_size < 2 * BLOCK_OVERHEAD)
-        return 0;
-
-    /* Get current pool information */
-    void *current_pool_start =
-        tlsf_resize(t, t->size); /* Ensure current pool is available */
-    if (!current_pool_start)
+    size_t skip = (size_t) (start - (char *) mem);
+    if (size < skip + BLOCK_OVERHEAD + BLOCK_SIZE_MIN)
         return 0;
+    size = (size - skip) & ~(ALIGN_SIZE - 1);
 
-    char *current_pool_end = (char *) current_pool_start + t->size;
-
-    /* Only support coalescing if the new memory is immediately adjacent to the
-     * current pool
-     */
-    if (start != current_pool_end)
+    char *base = (char *) arena_resize(t, t->size);
+    if (!base || start != base + t->size)
         return 0;
 
-    /* Update the pool size first to include the new memory */
-    size_t old_size = t->size;
-    size_t new_total_size = t->size + aligned_size;
-
-    /* Try to resize the pool to include the new memory */
-    void *resized_pool = tlsf_resize(t, new_total_size);
-    if (!resized_pool)
+    /* The new free block, merged with a free last block, must fit a bin. */
+    tlsf_block_t *sentinel = to_block(start - 2 * BLOCK_OVERHEAD);
+    check_sentinel(sentinel);
+    size_t merged = block_is_prev_free(sentinel)
+                        ? block_size(block_prev(sentinel)) + BLOCK_OVERHEAD
+                        : 0;
+    if (size - BLOCK_OVERHEAD > TLSF_MAX_SIZE - merged ||
+        !arena_resize(t, t->size + size))
         return 0;
 
-    /* Update our pool size */
-    t->size = new_total_size;
-
-    /* Find the current sentinel block */
-    tlsf_block_t *old_sentinel =
-        to_block((char *) resized_pool + old_size - 2 * BLOCK_OVERHEAD);
-    check_sentinel(old_sentinel);
-
-    /* Check if the block before the sentinel is free */
-    tlsf_block_t *last_block = NULL;
-    if (block_is_prev_free(old_sentinel)) {
-        last_block = block_prev(old_sentinel);
-        ASSERT(last_block && block_is_free(last_block),
-               "last block should be free");
-        /* Remove the last free block from lists since we'll recreate it */
-        block_remove(t, last_block);
-    }
-
-    /* Calculate the new free block size */
-    size_t new_free_size =
-        aligned_size + BLOCK_OVERHEAD; /* Include old sentinel space */
-    tlsf_block_t *new_free_block;
-
-    if (last_block) {
-        /* Merge with the existing free block */
-        new_free_size += block_size(last_block) + BLOCK_OVERHEAD;
-        new_free_block = last_block;
-    } else {
-        /* Convert the old sentinel into the start of the new free block */
-        new_free_block = old_sentinel;
-    }
-
-    /* Set up the new free block header */
-    new_free_block->header = new_free_size | BLOCK_BIT_FREE;
-
-    /* Set up proper linking for the new free block */
-    if (!last_block && old_size > 2 * BLOCK_OVERHEAD) {
-        /* There's a previous block, find it by scanning backwards */
-        char *scan_start = (char *) old_sentinel - BLOCK_OVERHEAD;
-        char *pool_start = (char *) resized_pool;
-
-        /* Simple backward scan to find the previous block */
-        for (char *scan_ptr = scan_start; scan_ptr >= pool_start;
-             scan_ptr -= ALIGN_SIZE) {
-            tlsf_block_t *candidate = to_block(scan_ptr - BLOCK_OVERHEAD);
-            if ((char *) candidate >= pool_start &&
-                (char *) candidate + BLOCK_OVERHEAD + block_size(candidate) ==
-                    (char *) old_sentinel) {
-                new_free_block->prev = candidate;
-                block_set_prev_free(new_free_block, block_is_free(candidate));
-                break;
-            }
-        }
-    }
-
-    /* Insert the new free block into the appropriate list */
-    block_insert(t, new_free_block);
-
-    /* Create a new sentinel at the end */
-    tlsf_block_t *new_sentinel = block_link_next(new_free_block);
-    new_sentinel->header = BLOCK_BIT_PREV_FREE;
-    check_sentinel(new_sentinel);
-
-    return aligned_size;
+    arena_extend(t, base, t->size + BLOCK_OVERHEAD, size - BLOCK_OVERHEAD);
+    TRACE(APPEND, t, start, t->size, size);
+    return size;
 }
 
 static void arena_shrink(tlsf_t *t, tlsf_block_t *block)
@@ -568,48 +915,130 @@ static void arena_shrink(tlsf_t *t, tlsf_block_t *block)
     t->size = t->size - size - BLOCK_OVERHEAD;
     if (t->size == BLOCK_OVERHEAD)
         t->size = 0;
-    tlsf_resize(t, t->size);
+    /* The block becomes the new sentinel, anything past it is gone. */
+    if (!t->size || link_get(t, t->check_block) > block)
+        t->check_block = link_make(t, NULL);
+    if (!t->size || link_get(t, t->compact_block) > block)
+        t->compact_block = link_make(t, NULL);
+    arena_resize(t, t->size);
     if (t->size) {
         block->header = 0;
         check_sentinel(block);
     }
+    TRACE(SHRINK, t, block, t->size, size + BLOCK_OVERHEAD);
+}
+
+/* Release a free last block to the backend, except for its first @keep
+ * bytes, which stay in the free lists.
+ */
+static void arena_trim(tlsf_t *t, tlsf_block_t *block, size_t keep)
+{
+    if (!keep) {
+        arena_shrink(t, block);
+        return;
+    }
+    if (keep < block_size(block))
+        keep = adjust_size(keep, ALIGN_SIZE);
+    if (keep >= block_size(block) || !block_can_split(block, keep)) {
+        block_insert(t, block);
+        return;
+    }
+    tlsf_block_t *rest = block_split(block, keep);
+    block_link_next(block);
+    block_insert(t, block);
+    arena_shrink(t, rest);
+    block_set_prev_free(rest, true);
 }
 
-INLINE tlsf_block_t *block_find_free(tlsf_t *t, size_t *size)
+/* Grow a used block in place to at least @size bytes by absorbing the next
+ * free block. The last block of the arena may grow the arena instead.
+ */
+static bool block_expand(tlsf_t *t, tlsf_block_t *block, size_t size)
+{
+    ASSERT(!block_is_free(block), "block must be used");
+    size_t avail = block_size(block);
+    tlsf_block_t *next = block_next(block), *tail = next;
+    if (block_is_free(next)) {
+        avail += block_size(next) + BLOCK_OVERHEAD;
+        tail = block_next(next);
+    }
+
+    if (size > avail) {
+        if (block_size(tail) || (t->hints & TLSF_HINT_NOGROW) ||
+            !arena_grow(t, adjust_size(size - avail - BLOCK_OVERHEAD,
+                                       ALIGN_SIZE)))
+            return false;
+        ASSERT(block_is_free(block_next(block)), "grown block must be free");
+    }
+
+    block_merge_next(t, block);
+    block_set_prev_free(block_next(block), false);
+    return true;
+}
+
+/* Return the lowest (or, with @high, the highest) of the first ORDER_WALK
+ * blocks of the free list starting at @block. All of them fit the request.
+ */
+static tlsf_block_t *bin_pick(tlsf_block_t *block, bool high)
+{
+    tlsf_block_t *best = block;
+    block = link_get(block, block->next_free);
+    for (unsigned i = 1; block && i < ORDER_WALK; i++) {
+        if (high ? block > best : block < best)
+            best = block;
+        block = link_get(block, block->next_free);
+    }
+    return best;
+}
+
+INLINE tlsf_block_t *block_find_free(tlsf_t *t, size_t *size, uint32_t hints)
 {
     *size = round_block_size(*size);
     uint32_t fl, sl;
     mapping(*size, &fl, &sl);
     tlsf_block_t *block = block_find_suitable(t, &fl, &sl);
     if (UNLIKELY(!block)) {
-        if (!arena_grow(t, *size))
+        if ((hints & TLSF_HINT_NOGROW) || !arena_grow(t, *size)) {
+            TRACE(FAIL, t, NULL, *size, 0);
+            if (t->low_water && t->low)
+                t->low(t, 0);
             return NULL;
+        }
         block = block_find_suitable(t, &fl, &sl);
         ASSERT(block, "no block found");
     }
 
-    /* Update size to match the FL/SL bin that was actually used.
-     * This ensures that when the block is freed, it will be placed in the same
-     * bin it was allocated from.
+    /* Keep the rounded request rather than the size of the bin the block was
+     * found in, the remainder is split off by block_use(). Otherwise a small
+     * request consumes most of a large block, e.g. a freshly grown arena.
      */
-    *size = mapping_size(fl, sl);
+    if (UNLIKELY(hints & (TLSF_HINT_LONG_LIVED | TLSF_HINT_SHORT_LIVED)))
+        block = bin_pick(block, hints & TLSF_HINT_SHORT_LIVED);
     ASSERT(block_size(block) >= *size, "insufficient block size");
     remove_free_block(t, block, fl, sl);
     return block;
 }
 
-void *tlsf_malloc(tlsf_t *t, size_t size)
+INLINE void *arena_malloc(tlsf_t *t, size_t size, uint32_t hints)
 {
     size = adjust_size(size, ALIGN_SIZE);
     if (UNLIKELY(size > TLSF_MAX_SIZE))
         return NULL;
-    tlsf_block_t *block = block_find_free(t, &size);
+    tlsf_block_t *block = block_find_free(t, &size, hints);
     if (UNLIKELY(!block))
         return NULL;
+    /* Keep short-lived blocks away from the low end of free space, where
+     * long-lived ones are placed, so that they do not pin it when freed.
+     */
+    if (UNLIKELY(hints & TLSF_HINT_SHORT_LIVED) && block_can_split(block, size))
+        block = block_carve_high(t, block, size);
     return block_use(t, block, size);
 }
 
-void *tlsf_aalloc(tlsf_t *t, size_t align, size_t size)
+INLINE void *arena_aalloc(tlsf_t *t,
+                          size_t align,
+                          size_t size,
+                          uint32_t hints)
 {
     size_t adjust = adjust_size(size, ALIGN_SIZE);
 
@@ -622,11 +1051,11 @@ void *tlsf_aalloc(tlsf_t *t, size_t align, size_t size)
         return NULL;
 
     if (align <= ALIGN_SIZE)
-        return tlsf_malloc(t, size);
+        return arena_malloc(t, size, hints);
 
     size_t asize =
         adjust_size(adjust + align - 1 + sizeof(tlsf_block_t), align);
-    tlsf_block_t *block = block_find_free(t, &asize);
+    tlsf_block_t *block = block_find_free(t, &asize, hints);
     if (UNLIKELY(!block))
         return NULL;
 
@@ -635,20 +1064,48 @@ void *tlsf_aalloc(tlsf_t *t, size_t align, size_t size)
     return block_use(t, block, adjust);
 }
 
+void *tlsf_malloc(tlsf_t *t, size_t size)
+{
+    void *mem = page_alloc(t, 0, size);
+    return UNLIKELY(mem) ? mem : arena_malloc(t, size, t->hints);
+}
+
+void *tlsf_malloc_hint(tlsf_t *t, size_t size, uint32_t hints)
+{
+    void *mem = page_alloc(t, 0, size);
+    return UNLIKELY(mem) ? mem : arena_malloc(t, size, hints | t->hints);
+}
+
+void *tlsf_aalloc(tlsf_t *t, size_t align, size_t size)
+{
+    void *mem = page_alloc(t, align, size);
+    return UNLIKELY(mem) ? mem : arena_aalloc(t, align, size, t->hints);
+}
+
 void tlsf_free(tlsf_t *t, void *mem)
 {
     if (UNLIKELY(!mem))
         return;
+#ifdef TLSF_ENABLE_PAGES
+    if (UNLIKELY(page_run(t, mem))) {
+        tlsf_pages_free(t, mem);
+        return;
+    }
+#endif
 
     tlsf_block_t *block = block_from_payload(mem);
     ASSERT(!block_is_free(block), "block already marked as free");
 
+    tag_release(t, block);
+    prof_release(t, block);
+    index_clear(t, block);
+    block->header &= ~BLOCK_META;
     block_set_free(block, true);
     block = block_merge_prev(t, block);
     block = block_merge_next(t, block);
 
     if (UNLIKELY(!block_size(block_next(block))))
-        arena_shrink(t, block);
+        arena_trim(t, block, t->retain);
     else
         block_insert(t, block);
 }
@@ -665,6 +1122,20 @@ void *tlsf_realloc(tlsf_t *t, void *mem, size_t size)
     if (UNLIKELY(!mem))
         return tlsf_malloc(t, size);
 
+    /* Pages are kept unless at most half of them would remain in use. */
+    size_t run = page_run(t, mem);
+    if (UNLIKELY(run)) {
+        if (size <= run && size > run / 2)
+            return mem;
+        void *dst = tlsf_malloc(t, size);
+        if (dst) {
+            memcpy(dst, mem, size < run ? size : run);
+            tlsf_free(t, mem);
+            TRACE(RELOCATE, t, dst, size, mem);
+        }
+        return dst;
+    }
+
     tlsf_block_t *block = block_from_payload(mem);
     size_t avail = block_size(block);
     size = adjust_size(size, ALIGN_SIZE);
@@ -673,29 +1144,391 @@ void *tlsf_realloc(tlsf_t *t, void *mem, size_t size)
 
     ASSERT(!block_is_free(block), "block already marked as free");
 
-    /* Do we need to expand to the next block? */
-    if (size > avail) {
-        /* If the next block is used or too small, we must relocate and copy. */
-        tlsf_block_t *next = block_next(block);
-        if (!block_is_free(next) ||
-            size > avail + block_size(next) + BLOCK_OVERHEAD) {
-            void *dst = tlsf_malloc(t, size);
-            if (dst) {
-                memcpy(dst, mem, avail);
-                tlsf_free(t, mem);
-            }
-            return dst;
+    /* If the block cannot be expanded in place, we must relocate and copy. */
+    tag_release(t, block);
+    if (size > avail && !block_expand(t, block, size)) {
+        tag_alloc(t, block);
+        void *dst = tlsf_malloc(t, size);
+        if (dst) {
+            memcpy(dst, mem, avail);
+            block_copy_tag(t, block_from_payload(dst), block);
+            tlsf_free(t, mem);
+            TRACE(RELOCATE, t, dst, size, mem);
         }
-
-        block_merge_next(t, block);
-        block_set_prev_free(block_next(block), false);
+        return dst;
     }
 
     /* Trim the resulting block and return the original pointer. */
     block_rtrim_used(t, block, size);
+    tag_alloc(t, block);
+    return mem;
+}
+
+void *tlsf_try_expand(tlsf_t *t, void *mem, size_t size)
+{
+    if (UNLIKELY(!mem))
+        return NULL;
+    size_t run = page_run(t, mem);
+    if (UNLIKELY(run))
+        return size <= run ? mem : NULL;
+
+    tlsf_block_t *block = block_from_payload(mem);
+    ASSERT(!block_is_free(block), "block already marked as free");
+    size = adjust_size(size, ALIGN_SIZE);
+    if (size <= block_size(block))
+        return mem;
+    if (UNLIKELY(size > TLSF_MAX_SIZE))
+        return NULL;
+
+    tag_release(t, block);
+    void *res = NULL;
+    if (block_expand(t, block, size)) {
+        block_rtrim_used(t, block, size);
+        res = mem;
+    }
+    tag_alloc(t, block);
+    return res;
+}
+
+void tlsf_shrink_in_place(tlsf_t *t, void *mem, size_t size)
+{
+    if (UNLIKELY(!mem || page_run(t, mem)))
+        return;
+
+    tlsf_block_t *block = block_from_payload(mem);
+    ASSERT(!block_is_free(block), "block already marked as free");
+    tag_release(t, block);
+    block_rtrim_used(t, block, adjust_size(size, ALIGN_SIZE));
+    tag_alloc(t, block);
+}
+
+void tlsf_handles_init(tlsf_handles_t *h, tlsf_handle_t *slots, size_t count)
+{
+    h->slots = slots;
+    h->count = count;
+    h->free = NULL;
+    /* Unused slots are chained through their ptr field. */
+    for (size_t i = count; i--;) {
+        slots[i].ptr = h->free;
+        slots[i].pins = 0;
+        h->free = &slots[i];
+    }
+}
+
+tlsf_handle_t *tlsf_halloc(tlsf_t *t, tlsf_handles_t *h, size_t size)
+{
+    tlsf_handle_t *slot = h->free;
+    if (UNLIKELY(!slot || size > TLSF_MAX_SIZE - sizeof(void *)))
+        return NULL;
+
+    /* The payload starts with a pointer back to the handle. */
+    void **mem = (void **) tlsf_malloc(t, size + sizeof(void *));
+    if (UNLIKELY(!mem))
+        return NULL;
+    h->free = (tlsf_handle_t *) slot->ptr;
+    mem[0] = slot;
+    slot->ptr = mem + 1;
+    slot->pins = 0;
+    return slot;
+}
+
+void tlsf_hfree(tlsf_t *t, tlsf_handles_t *h, tlsf_handle_t *slot)
+{
+    if (UNLIKELY(!slot))
+        return;
+    ASSERT(!slot->pins, "handle is still pinned");
+    tlsf_free(t, (void **) slot->ptr - 1);
+    slot->ptr = h->free;
+    h->free = slot;
+}
+
+/* Return the handle of a used block if it may be moved. Only blocks whose
+ * back pointer refers to a handle that refers back to them qualify, which
+ * no other payload can fake.
+ */
+static tlsf_handle_t *block_handle(tlsf_handles_t *h, tlsf_block_t *block)
+{
+    /* The sentinel has no payload, it would lie past the arena. */
+    if (block_is_free(block) || !block_size(block))
+        return NULL;
+    void **mem = (void **) block_payload(block);
+    tlsf_handle_t *slot = (tlsf_handle_t *) mem[0];
+    size_t off = (size_t) ((char *) slot - (char *) h->slots);
+    if (off >= h->count * sizeof(tlsf_handle_t) ||
+        off % sizeof(tlsf_handle_t) || slot->ptr != mem + 1 || slot->pins)
+        return NULL;
+    return slot;
+}
+
+/* Slide a used block down into the free hole preceding it. The hole
+ * reappears behind the block and is merged with whatever follows.
+ */
+static tlsf_block_t *block_slide(tlsf_t *t,
+                                 tlsf_block_t *hole,
+                                 tlsf_block_t *block,
+                                 tlsf_handle_t *slot)
+{
+    size_t hole_size = block_size(hole), size = block_size(block);
+    ASSERT(block_is_free(hole) && !block_is_prev_free(hole),
+           "hole must be a coalesced free block");
+
+    /* Keeps size and metadata; the hole before it is gone. */
+    size_t header = block->header & ~BLOCK_BIT_PREV_FREE;
+
+    block_remove(t, hole);
+    cursor_absorb(t, hole, block);
+    index_clear(t, block);
+    index_set(t, hole);
+    memmove(block_payload(hole), block_payload(block), size);
+    hole->header = header;
+    slot->ptr = (void **) block_payload(hole) + 1;
+#ifdef TLSF_ENABLE_PROFILE
+    if (UNLIKELY(header & BLOCK_BIT_SAMPLED))
+        tlsf_prof_move(t, block_payload(block), block_payload(hole));
+#endif
+
+    tlsf_block_t *rest = block_next(hole);
+    rest->header = hole_size | BLOCK_BIT_FREE;
+    block_set_prev_free(block_link_next(rest), true);
+    rest = block_merge_next(t, rest);
+    if (!block_size(block_next(rest)))
+        arena_trim(t, rest, t->retain);
+    else
+        block_insert(t, rest);
+    return rest;
+}
+
+bool tlsf_compact(tlsf_t *t, tlsf_handles_t *h, size_t budget)
+{
+    if (!t->size)
+        return true;
+
+    char *base = (char *) arena_resize(t, t->size);
+    if (!base)
+        return true;
+    tlsf_block_t *block = link_get(t, t->compact_block);
+    if (!block)
+        block = to_block(base - BLOCK_OVERHEAD);
+
+    for (; budget; budget--) {
+        if (!block_size(block)) {
+            t->compact_block = link_make(t, NULL);
+            return true;
+        }
+
+        tlsf_block_t *next = block_next(block);
+        tlsf_handle_t *slot;
+        if (block_is_free(block) && (slot = block_handle(h, next))) {
+            block = block_slide(t, block, next, slot);
+            if (!t->size)
+                return true;
+        } else {
+            block = next;
+        }
+    }
+
+    t->compact_block = link_make(t, block);
+    return false;
+}
+
+#ifdef TLSF_ENABLE_TAGS
+/* Move a new allocation from the untagged account to @tag. */
+static void *tag_assign(tlsf_t *t, void *mem, unsigned tag)
+{
+    ASSERT(tag < TLSF_TAG_COUNT, "invalid tag");
+    if (mem && tag) {
+        tlsf_block_t *block = block_from_payload(mem);
+        tag_release(t, block);
+        block->header |= (size_t) (tag & (TLSF_TAG_COUNT - 1))
+                         << BLOCK_TAG_SHIFT;
+        tag_alloc(t, block);
+    }
     return mem;
 }
 
+void *tlsf_malloc_tagged(tlsf_t *t, size_t size, unsigned tag)
+{
+    return tag_assign(t, arena_malloc(t, size, t->hints), tag);
+}
+
+void *tlsf_aalloc_tagged(tlsf_t *t, size_t align, size_t size, unsigned tag)
+{
+    return tag_assign(t, arena_aalloc(t, align, size, t->hints), tag);
+}
+
+void tlsf_tag_stats(const tlsf_t *t, tlsf_tag_stat_t *stats)
+{
+    memcpy(stats, t->tags, sizeof(t->tags));
+}
+#endif
+
+#ifdef TLSF_ENABLE_INDEX
+void *tlsf_find_block(const tlsf_t *t, const void *addr, size_t *size)
+{
+    char *mem = t->index ? (char *) tlsf_index_find(t, addr) : NULL;
+    if (!mem)
+        return NULL;
+    tlsf_block_t *block = block_from_payload(mem);
+    if ((const char *) addr >= mem + block_size(block))
+        return NULL;
+    if (size)
+        *size = block_size(block);
+    return mem;
+}
+#endif
+
+bool tlsf_reserve(tlsf_t *t, size_t size)
+{
+    size = adjust_size(size, ALIGN_SIZE);
+    if (size > TLSF_MAX_SIZE)
+        return false;
+
+    size_t avail = 0;
+    if (t->size) {
+        char *base = (char *) arena_resize(t, t->size);
+        if (!base)
+            return false;
+        tlsf_block_t *sentinel = to_block(base + t->size - 2 * BLOCK_OVERHEAD);
+        if (block_is_prev_free(sentinel))
+            avail = block_size(block_prev(sentinel));
+    }
+    if (avail >= size)
+        return true;
+
+    /* A grown block merges with the free block before it. */
+    return arena_grow(t, avail ? adjust_size(size - avail - BLOCK_OVERHEAD,
+                                             ALIGN_SIZE)
+                               : size);
+}
+
+void tlsf_trim(tlsf_t *t, size_t keep)
+{
+    if (!t->size)
+        return;
+    char *base = (char *) arena_resize(t, t->size);
+    if (!base)
+        return;
+    tlsf_block_t *sentinel = to_block(base + t->size - 2 * BLOCK_OVERHEAD);
+    if (!block_is_prev_free(sentinel))
+        return;
+    tlsf_block_t *block = block_prev(sentinel);
+    block_remove(t, block);
+    arena_trim(t, block, keep);
+}
+
+void tlsf_reset(tlsf_t *t)
+{
+#ifdef TLSF_ENABLE_PAGES
+    tlsf_pages_reset(t);
+#endif
+    if (!t->size)
+        return;
+    char *base = (char *) arena_resize(t, t->size);
+    if (!base)
+        return;
+
+    for (tlsf_fl_map_t fl = t->fl; fl; fl &= fl - 1) {
+        uint32_t i = fl_map_ffs(fl);
+        for (tlsf_sl_map_t sl = t->sl[i]; sl; sl &= sl - 1)
+            t->block[i][sl_map_ffs(sl)] = link_make(t, NULL);
+        t->sl[i] = 0;
+    }
+    t->fl = 0;
+    t->check_block = t->compact_block = link_make(t, NULL);
+#ifdef TLSF_ENABLE_TAGS
+    memset(t->tags, 0, sizeof(t->tags));
+#endif
+#ifdef TLSF_ENABLE_PROFILE
+    tlsf_prof_reset(t);
+#endif
+
+#ifdef TLSF_ENABLE_INDEX
+    if (t->index)
+        tlsf_index_release(t, base);
+#endif
+    tlsf_block_t *block = to_block(base - BLOCK_OVERHEAD);
+    block->header = (t->size - 2 * BLOCK_OVERHEAD) | BLOCK_BIT_FREE;
+    tlsf_block_t *sentinel = block_link_next(block);
+    sentinel->header = BLOCK_BIT_PREV_FREE;
+    check_sentinel(sentinel);
+    block_insert(t, block);
+}
+
+bool tlsf_mark(tlsf_t *t, size_t *mark)
+{
+    if (!t->size) {
+        *mark = 0;
+        return true;
+    }
+
+    /* The fence is carved from the last block, which must be free. */
+    char *base = (char *) arena_resize(t, t->size);
+    if (!base)
+        return false;
+    tlsf_block_t *fence = to_block(base + t->size - 2 * BLOCK_OVERHEAD);
+    if (block_is_prev_free(fence)) {
+        fence = block_prev(fence);
+    } else if ((t->hints & TLSF_HINT_NOGROW) ||
+               !arena_grow(t, BLOCK_SIZE_MIN)) {
+        if (t->low_water && t->low)
+            t->low(t, 0);
+        return false;
+    }
+    block_remove(t, fence);
+    block_rtrim_free(t, fence, BLOCK_SIZE_MIN);
+    block_set_free(fence, false);
+    index_set(t, fence);
+    *mark = (size_t) (block_payload(fence) - base);
+    return true;
+}
+
+void tlsf_release(tlsf_t *t, size_t mark)
+{
+    if (!mark) {
+        tlsf_reset(t);
+        char *base = t->size ? (char *) arena_resize(t, t->size) : NULL;
+        if (base) {
+            tlsf_block_t *block = to_block(base - BLOCK_OVERHEAD);
+            block_remove(t, block);
+            arena_shrink(t, block);
+        }
+        return;
+    }
+
+    ASSERT(mark < t->size, "mark is beyond the arena");
+    char *base = (char *) arena_resize(t, t->size);
+    if (!base)
+        return;
+    tlsf_block_t *fence = block_from_payload(base + mark);
+    ASSERT(!block_is_free(fence), "mark was already released");
+#ifdef TLSF_ENABLE_INDEX
+    if (t->index)
+        tlsf_index_release(t, block_payload(fence));
+#endif
+
+    /* Turn the fence into one free block reaching up to the sentinel. The
+     * cursors must not stay on the headers of the blocks it swallows, as
+     * the retained part of it is not trimmed away.
+     */
+    size_t size = block_size(fence);
+    tlsf_block_t *block = block_next(fence);
+    for (; block_size(block); block = block_next(block)) {
+        cursor_absorb(t, fence, block);
+        if (block_is_free(block)) {
+            block_remove(t, block);
+        } else {
+            tag_release(t, block);
+            prof_release(t, block);
+        }
+        size += block_size(block) + BLOCK_OVERHEAD;
+    }
+    check_sentinel(block);
+    block_set_size(fence, size);
+    block_set_free(fence, true);
+    fence = block_merge_prev(t, fence);
+    arena_trim(t, fence, t->retain);
+}
+
 size_t tlsf_append_pool(tlsf_t *t, void *mem, size_t size)
 {
     if (UNLIKELY(!t || !mem || !size))
@@ -704,6 +1537,182 @@ size_t tlsf_append_pool(tlsf_t *t, void *mem, size_t size)
     return arena_append_pool(t, mem, size);
 }
 
+#ifdef TLSF_ENABLE_PIC
+/* Identifies a heap header with the same geometry as this build. */
+#define PIC_MAGIC                                                    \
+    ((uint32_t) 'T' << 24 | (uint32_t) FL_COUNT << 16 |              \
+     (uint32_t) SL_COUNT << 8 | (uint32_t) ALIGN_SHIFT)
+
+tlsf_t *tlsf_attach(void *mem, tlsf_resize_fn resize, void *ctx)
+{
+    tlsf_t *t = (tlsf_t *) mem;
+    if (UNLIKELY(!t || (size_t) t % sizeof(size_t)))
+        return NULL;
+
+    /* A zero-filled header describes a new heap. */
+    if (!t->magic && !t->size && !t->fl) {
+        *t = TLSF_INIT;
+        t->magic = PIC_MAGIC;
+        t->resize = resize;
+        t->resize_ctx = ctx;
+        return t;
+    }
+
+    if (t->magic != PIC_MAGIC || t->size % ALIGN_SIZE ||
+        (t->size && t->size < 2 * BLOCK_OVERHEAD + BLOCK_SIZE_MIN))
+        return NULL;
+#ifdef TLSF_ENABLE_PROFILE
+    /* A profiler belongs to the process which mapped the heap before. */
+    t->prof = NULL;
+    t->prof_countdown = 0;
+#endif
+#ifdef TLSF_ENABLE_PAGES
+    t->pages = NULL;
+    t->page_min = 0;
+#endif
+#ifdef TLSF_ENABLE_INDEX
+    t->index = NULL;
+    t->index_max = 0;
+#endif
+    /* So do the backend and watermark functions. */
+    t->resize = resize;
+    t->resize_ctx = ctx;
+    t->low = NULL;
+    if (!t->size)
+        return t;
+
+    /* The arena must be reachable again and still end in a sentinel. */
+    char *base = (char *) arena_resize(t, t->size);
+    if (!base || (size_t) base % ALIGN_SIZE)
+        return NULL;
+    tlsf_block_t *sentinel = to_block(base + t->size - 2 * BLOCK_OVERHEAD);
+    if (block_size(sentinel) || block_is_free(sentinel))
+        return NULL;
+    return t;
+}
+#endif
+
+/* Check that @p may be dereferenced as a block header of the arena. */
+INLINE bool check_in_arena(const tlsf_block_t *first,
+                           const tlsf_block_t *sentinel,
+                           const tlsf_block_t *p)
+{
+    return p >= first && p <= sentinel && !((size_t) p % ALIGN_SIZE);
+}
+
+/* Verify the bitmaps and the list head of a single FL/SL bin. */
+static bool check_bin(tlsf_t *t,
+                      const tlsf_block_t *first,
+                      const tlsf_block_t *sentinel,
+                      uint32_t fl,
+                      uint32_t sl)
+{
+    tlsf_block_t *head = link_get(t, t->block[fl][sl]);
+    bool fl_set = !!(t->fl & FL_BIT(fl)), sl_set = !!(t->sl[fl] & SL_BIT(sl));
+
+    if (fl_set != !!t->sl[fl] || sl_set != !!head)
+        return false;
+    if (!head)
+        return true;
+    if (!check_in_arena(first, sentinel, head) || head == sentinel ||
+        !block_is_free(head) || link_get(head, head->prev_free) ||
+        block_size(head) >> FL_MAX)
+        return false;
+
+    uint32_t hfl, hsl;
+    mapping(block_size(head), &hfl, &hsl);
+    return hfl == fl && hsl == sl;
+}
+
+/* Verify a single block against its physical and free-list neighbours. */
+static bool check_block(tlsf_t *t,
+                        tlsf_block_t *first,
+                        tlsf_block_t *sentinel,
+                        tlsf_block_t *block)
+{
+    if (!check_in_arena(first, sentinel, block))
+        return false;
+    if (block == first && block_is_prev_free(block))
+        return false;
+    if (block == sentinel)
+        return !block_size(block) && !block_is_free(block);
+
+    size_t size = block_size(block);
+    if (size < BLOCK_SIZE_MIN || size % ALIGN_SIZE || size >> FL_MAX ||
+        size > (size_t) ((char *) sentinel - (char *) block))
+        return false;
+#ifdef TLSF_ENABLE_INDEX
+    /* Exactly the used blocks are marked in the index. */
+    if (t->index && (tlsf_index_find(t, block_payload(block)) ==
+                     block_payload(block)) == block_is_free(block))
+        return false;
+#endif
+
+    tlsf_block_t *next = block_next(block);
+    if (!check_in_arena(first, sentinel, next))
+        return false;
+    if (!block_is_free(block))
+        return !block_is_prev_free(next);
+
+    /* Free blocks: coalesced, linked from the next block and listed. */
+    if (block_is_prev_free(block) || block_is_free(next) ||
+        !block_is_prev_free(next) || link_get(next, next->prev) != block)
+        return false;
+
+    uint32_t fl, sl;
+    mapping(size, &fl, &sl);
+    if (!(t->fl & FL_BIT(fl)) || !(t->sl[fl] & SL_BIT(sl)))
+        return false;
+
+    tlsf_block_t *prev_free = link_get(block, block->prev_free);
+    tlsf_block_t *next_free = link_get(block, block->next_free);
+    if (prev_free) {
+        if (!check_in_arena(first, sentinel, prev_free) ||
+            link_get(prev_free, prev_free->next_free) != block)
+            return false;
+    } else if (link_get(t, t->block[fl][sl]) != block) {
+        return false;
+    }
+    if (next_free && (!check_in_arena(first, sentinel, next_free) ||
+                      link_get(next_free, next_free->prev_free) != block))
+        return false;
+    return true;
+}
+
+bool tlsf_check_step(tlsf_t *t, size_t budget)
+{
+    if (!t->size) {
+        t->check_block = link_make(t, NULL);
+        return true;
+    }
+
+    char *base = (char *) arena_resize(t, t->size);
+    if (!base)
+        return false;
+
+    tlsf_block_t *first = to_block(base - BLOCK_OVERHEAD);
+    tlsf_block_t *sentinel = to_block(base + t->size - 2 * BLOCK_OVERHEAD);
+    tlsf_block_t *block = link_get(t, t->check_block);
+    if (!block)
+        block = first;
+
+    while (budget--) {
+        uint32_t bin = t->check_bin;
+        t->check_bin = (bin + 1) % (FL_COUNT * SL_COUNT);
+        if (!check_bin(t, first, sentinel, bin / SL_COUNT, bin % SL_COUNT))
+            return false;
+
+        if (!check_block(t, first, sentinel, block)) {
+            t->check_block = link_make(t, NULL);
+            return false;
+        }
+        block = block == sentinel ? first : block_next(block);
+    }
+
+    t->check_block = link_make(t, block);
+    return true;
+}
+
 #ifdef TLSF_ENABLE_CHECK
 #include <stdio.h>
 #include <stdlib.h>
@@ -718,9 +1727,9 @@ void tlsf_check(tlsf_t *t)
 {
     for (uint32_t i = 0; i < FL_COUNT; ++i) {
         for (uint32_t j = 0; j < SL_COUNT; ++j) {
-            size_t fl_map = t->fl & (1U << i), sl_list = t->sl[i],
-                   sl_map = sl_list & (1U << j);
-            tlsf_block_t *block = t->block[i][j];
+            tlsf_fl_map_t fl_map = t->fl & FL_BIT(i);
+            tlsf_sl_map_t sl_list = t->sl[i], sl_map = sl_list & SL_BIT(j);
+            tlsf_block_t *block = link_get(t, t->block[i][j]);
 
             /* Check that first- and second-level lists agree. */
             if (!fl_map)
@@ -748,9 +1757,24 @@ void tlsf_check(tlsf_t *t)
 
                 mapping(block_size(block), &fl, &sl);
                 CHECK(fl == i && sl == j, "block size indexed in wrong list");
-                block = block->next_free;
+                block = link_get(block, block->next_free);
             }
         }
     }
+
+#ifdef TLSF_ENABLE_INDEX
+    /* An indexed heap is walked, as the index covers the used blocks. */
+    if (!t->index || !t->size)
+        return;
+    char *base = (char *) arena_resize(t, t->size);
+    CHECK(base, "arena must be mapped");
+    tlsf_block_t *first = to_block(base - BLOCK_OVERHEAD);
+    tlsf_block_t *sentinel = to_block(base + t->size - 2 * BLOCK_OVERHEAD);
+    for (tlsf_block_t *block = first;; block = block_next(block)) {
+        CHECK(check_block(t, first, sentinel, block), "invalid block");
+        if (block == sentinel)
+            break;
+    }
+#endif
 }
 #endif
@@ -9,34 +9,173 @@
 extern "C" {
 #endif /* __cplusplus */
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#define _TLSF_SL_COUNT 16
+/* Bin geometry. Each power of two (first level) is split into 2^SL_SHIFT
+ * bins (second level), up to blocks of 2^(FL_MAX - 1) bytes. Finer bins
+ * waste less memory to rounding, fewer levels make the tlsf_t smaller.
+ */
+#ifndef TLSF_SL_SHIFT
+#define TLSF_SL_SHIFT 4
+#endif
 #if __SIZE_WIDTH__ == 64
-#define _TLSF_FL_COUNT 32
-#define _TLSF_FL_MAX 38
+#define _TLSF_ALIGN_SHIFT 3
+#ifndef TLSF_FL_MAX
+#define TLSF_FL_MAX 38
+#endif
+#else
+#define _TLSF_ALIGN_SHIFT 2
+#ifndef TLSF_FL_MAX
+#define TLSF_FL_MAX 30
+#endif
+#endif
+
+#define _TLSF_SL_COUNT (1 << TLSF_SL_SHIFT)
+#define _TLSF_FL_MAX TLSF_FL_MAX
+#define _TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_SL_SHIFT - _TLSF_ALIGN_SHIFT + 1)
+
+#if _TLSF_SL_COUNT > 32
+typedef uint64_t tlsf_sl_map_t;
 #else
-#define _TLSF_FL_COUNT 25
-#define _TLSF_FL_MAX 30
+typedef uint32_t tlsf_sl_map_t;
+#endif
+#if _TLSF_FL_COUNT > 32
+typedef uint64_t tlsf_fl_map_t;
+#else
+typedef uint32_t tlsf_fl_map_t;
+#endif
+#ifdef TLSF_ENABLE_TAGS
+#if __SIZE_WIDTH__ != 64
+#error "TLSF_ENABLE_TAGS requires a 64-bit size_t"
+#endif
+#ifndef TLSF_TAG_COUNT
+#define TLSF_TAG_COUNT 16
+#endif
+
+/* Live usage of a tag. */
+typedef struct {
+    size_t bytes, count;
+} tlsf_tag_stat_t;
+#endif
+
+#if defined(TLSF_ENABLE_PROFILE) && __SIZE_WIDTH__ != 64
+#error "TLSF_ENABLE_PROFILE requires a 64-bit size_t"
 #endif
+
 #define TLSF_MAX_SIZE (((size_t) 1 << (_TLSF_FL_MAX - 1)) - sizeof(size_t))
 #define TLSF_INIT ((tlsf_t) {.size = 0})
 
-typedef struct {
-    uint32_t fl, sl[_TLSF_FL_COUNT];
-    struct tlsf_block *block[_TLSF_FL_COUNT][_TLSF_SL_COUNT];
+#ifdef TLSF_ENABLE_PIC
+/* Position-independent links, stored as offsets. See tlsf_attach(). */
+typedef size_t tlsf_link_t;
+#else
+typedef struct tlsf_block *tlsf_link_t;
+#endif
+
+typedef struct tlsf tlsf_t;
+
+/* Resize the arena of a heap to @size bytes. The arena must stay at the same
+ * address, which is returned, or NULL if it cannot be resized.
+ */
+typedef void *(*tlsf_resize_fn)(tlsf_t *, size_t size);
+
+/* Called when free memory at the end of the arena drops to @avail bytes,
+ * below the low watermark of the heap.
+ */
+typedef void (*tlsf_low_fn)(tlsf_t *, size_t avail);
+
+/* Allocation hints, see tlsf_malloc_hint() */
+enum {
+    TLSF_HINT_NOGROW = 1,      /* fail instead of growing the arena */
+    TLSF_HINT_LONG_LIVED = 2,  /* place at the lowest free address found */
+    TLSF_HINT_SHORT_LIVED = 4, /* carve from the high end of free space */
+};
+
+struct tlsf {
+    tlsf_fl_map_t fl;
+    tlsf_sl_map_t sl[_TLSF_FL_COUNT];
+    tlsf_link_t block[_TLSF_FL_COUNT][_TLSF_SL_COUNT];
     size_t size;
-} tlsf_t;
 
+    /* Backend of this heap, the global tlsf_resize() if NULL, and any data
+     * it needs
+     */
+    tlsf_resize_fn resize;
+    void *resize_ctx;
+
+    /* Resize policy, all zero to resize the arena by exactly what is needed.
+     * The arena grows by at least grow_pct percent of its size, and to a
+     * multiple of grow_step bytes. Up to retain bytes of free memory at its
+     * end are kept when blocks are freed, see tlsf_trim().
+     */
+    size_t grow_step, retain;
+    uint32_t grow_pct;
+
+    /* Free blocks of at least order_min bytes are kept (mostly) in address
+     * order within their bin, 0 for LIFO bins. Allocations then prefer low
+     * addresses, which leaves the end of the arena free to be released.
+     */
+    size_t order_min;
+
+    /* Hints applied to every allocation, e.g. TLSF_HINT_NOGROW for a heap
+     * whose arena is set up with tlsf_reserve(). low is called when an
+     * allocation leaves less than low_water bytes free at the end of the
+     * arena, or fails for lack of memory, 0 to disable it.
+     */
+    uint32_t hints;
+    size_t low_water;
+    tlsf_low_fn low;
+
+    /* Resumable positions of tlsf_check_step() and tlsf_compact() */
+    tlsf_link_t check_block, compact_block;
+    uint32_t check_bin;
+
+#ifdef TLSF_ENABLE_PIC
+    /* Layout identifier written by tlsf_attach() */
+    uint32_t magic;
+#endif
+
+#ifdef TLSF_ENABLE_TAGS
+    tlsf_tag_stat_t tags[TLSF_TAG_COUNT];
+#endif
+
+#ifdef TLSF_ENABLE_PROFILE
+    /* Bytes left until the next sample, and the profiler (tlsf_prof.c) */
+    ptrdiff_t prof_countdown;
+    struct tlsf_prof *prof;
+#endif
+
+#ifdef TLSF_ENABLE_PAGES
+    /* Smallest request served by the page allocator (tlsf_pages.c) */
+    size_t page_min;
+    struct tlsf_pages *pages;
+#endif
+
+#ifdef TLSF_ENABLE_INDEX
+    /* Interior-pointer index (tlsf_index.c), which covers arenas of up to
+     * index_max bytes
+     */
+    size_t index_max;
+    struct tlsf_index *index;
+#endif
+};
+
+/* Default backend for heaps without their own. The application only needs
+ * to provide it if it has such heaps.
+ */
 void *tlsf_resize(tlsf_t *, size_t);
-void *tlsf_aalloc(tlsf_t *, size_t, size_t);
 
 /**
  * Append a memory block to an existing pool, potentially coalescing with
  * the last block if it's free. Returns the number of bytes actually used
  * from the memory block for pool expansion.
  *
+ * The block must start right at the end of the arena, and the backend must
+ * accept the arena grown by it. Appending takes constant time, however large
+ * the pool is.
+ *
  * @param tlsf The TLSF allocator instance
  * @param mem Pointer to the memory block to append
  * @param size Size of the memory block in bytes
@@ -51,11 +190,229 @@ size_t tlsf_append_pool(tlsf_t *tlsf, void *mem, size_t size);
 void *tlsf_malloc(tlsf_t *, size_t size);
 void *tlsf_realloc(tlsf_t *, void *, size_t);
 
+/**
+ * Allocates @size bytes aligned to @align, a power of two, and returns a
+ * pointer to it. On failure, returns NULL.
+ */
+void *tlsf_aalloc(tlsf_t *, size_t align, size_t size);
+
+/**
+ * Allocate like tlsf_malloc(), with @hints in addition to those of the heap.
+ * With TLSF_HINT_NOGROW, the backend is never called, so the allocation
+ * takes constant time and fails if the arena has no suitable free block.
+ *
+ * TLSF_HINT_LONG_LIVED and TLSF_HINT_SHORT_LIVED segregate blocks by their
+ * expected lifetime: the former take the lowest of the first few fitting
+ * free blocks, the latter the highest, and are cut from its end. Short-lived
+ * blocks then do not get trapped between long-lived ones, and freeing them
+ * restores large free blocks.
+ */
+void *tlsf_malloc_hint(tlsf_t *, size_t size, uint32_t hints);
+
+/**
+ * Grow the arena, if needed, so that at least @size bytes are free in one
+ * block at its end, e.g. from a background thread for allocations which
+ * must not grow the arena. Set retain as well to keep the reserve when the
+ * blocks at the end are freed.
+ *
+ * @return false if the arena cannot be grown
+ */
+bool tlsf_reserve(tlsf_t *, size_t size);
+
 /**
  * Releases the previously allocated memory, given the pointer.
  */
 void tlsf_free(tlsf_t *, void *);
 
+/**
+ * Grow the block at @mem to at least @size bytes without moving it, by
+ * absorbing the following free block. If the block is the last one of the
+ * arena, the arena is grown instead.
+ *
+ * @return @mem on success, NULL if the block cannot grow in place, in which
+ *         case it is left untouched
+ */
+void *tlsf_try_expand(tlsf_t *, void *, size_t size);
+
+/**
+ * Shrink the block at @mem to @size bytes without moving it, returning the
+ * tail to the free lists. Requests larger than the block are ignored.
+ */
+void tlsf_shrink_in_place(tlsf_t *, void *, size_t size);
+
+/**
+ * Return free memory at the end of the arena to the backend, keeping at most
+ * @keep bytes. Together with the retain policy this releases memory only
+ * when convenient, e.g. from an idle hook.
+ */
+void tlsf_trim(tlsf_t *, size_t keep);
+
+/**
+ * Free all allocations at once, leaving the arena as a single free block.
+ * The arena keeps its size until the next tlsf_free() shrinks it. This takes
+ * constant time, as only the non-empty bins are cleared. Page allocations are
+ * freed as well.
+ */
+void tlsf_reset(tlsf_t *);
+
+/**
+ * Mark the current tail of the arena, placing a small used fence block there
+ * so that nothing coalesces across the mark. Allocations made afterwards
+ * from memory above the mark are released together by tlsf_release().
+ * Allocations served from free memory below the mark are not, so scopes are
+ * exact on a heap without free memory below the mark, e.g. after
+ * tlsf_reset().
+ *
+ * @param mark Receives the position of the mark, an offset into the arena
+ * @return false if the fence could not be allocated, e.g. if the last block
+ *         is used and the heap has TLSF_HINT_NOGROW
+ */
+bool tlsf_mark(tlsf_t *, size_t *mark);
+
+/**
+ * Free every block above @mark, including the fence and the blocks of later
+ * marks, and shrink the arena back to it. This walks the blocks above the
+ * mark, but performs no coalescing or free-list work for used blocks.
+ * Releasing a mark of an empty heap empties it.
+ */
+void tlsf_release(tlsf_t *, size_t mark);
+
+#ifdef TLSF_ENABLE_TAGS
+/**
+ * Allocate like tlsf_malloc() and tlsf_aalloc(), accounting the block to
+ * @tag (below TLSF_TAG_COUNT) until it is freed. The tag is kept in the block
+ * header and survives tlsf_realloc(). Untagged allocations count as tag 0.
+ */
+void *tlsf_malloc_tagged(tlsf_t *, size_t size, unsigned tag);
+void *tlsf_aalloc_tagged(tlsf_t *, size_t align, size_t size, unsigned tag);
+
+/**
+ * Copy the live bytes (including rounding) and block count of every tag to
+ * @stats, an array of TLSF_TAG_COUNT entries.
+ */
+void tlsf_tag_stats(const tlsf_t *, tlsf_tag_stat_t *stats);
+#endif
+
+#ifdef TLSF_ENABLE_INDEX
+/**
+ * Find the used block containing @addr, which may point anywhere into its
+ * payload, in constant time. Requires an index, see tlsf_index_init().
+ *
+ * @param size Set to the usable size of the block, if not NULL
+ * @return The payload of the block, or NULL if @addr is not inside a used
+ *         block of the arena
+ */
+void *tlsf_find_block(const tlsf_t *, const void *addr, size_t *size);
+#endif
+
+/* Relocatable allocations are referred to by handles. The payload may only
+ * be accessed between tlsf_pin() and tlsf_unpin(), since tlsf_compact() moves
+ * unpinned payloads. Handles are process-local, even with TLSF_ENABLE_PIC.
+ */
+typedef struct tlsf_handle {
+    void *ptr;
+    size_t pins;
+} tlsf_handle_t;
+
+/* Caller-provided table of handle slots. */
+typedef struct {
+    tlsf_handle_t *slots, *free;
+    size_t count;
+} tlsf_handles_t;
+
+void tlsf_handles_init(tlsf_handles_t *, tlsf_handle_t *slots, size_t count);
+
+/**
+ * Allocate @size relocatable bytes. Returns NULL if out of memory or slots.
+ */
+tlsf_handle_t *tlsf_halloc(tlsf_t *, tlsf_handles_t *, size_t size);
+void tlsf_hfree(tlsf_t *, tlsf_handles_t *, tlsf_handle_t *);
+
+static inline void *tlsf_pin(tlsf_handle_t *h)
+{
+    h->pins++;
+    return h->ptr;
+}
+
+static inline void tlsf_unpin(tlsf_handle_t *h)
+{
+    h->pins--;
+}
+
+/**
+ * Slide unpinned handle allocations toward the arena start, examining at most
+ * @budget blocks per call. Holes merge behind the moved blocks and a free
+ * tail is returned to the backend. The position is kept in the tlsf_t.
+ *
+ * @return true once a full pass over the arena has completed
+ */
+bool tlsf_compact(tlsf_t *, tlsf_handles_t *, size_t budget);
+
+/**
+ * Incrementally verify the heap, examining at most @budget blocks per call.
+ * Each step checks the physical neighbour links and free-list membership of
+ * one block and the bitmap of one FL/SL bin. The position is kept in the
+ * tlsf_t, so repeated calls (e.g. from an idle hook) cover the whole heap.
+ * Unlike tlsf_check(), this is always available and never aborts.
+ *
+ * @return false if an inconsistency was detected, true otherwise
+ */
+bool tlsf_check_step(tlsf_t *, size_t budget);
+
+#ifdef TLSF_ENABLE_PIC
+/**
+ * Attach to a heap whose tlsf_t lives at @mem, typically at the start of a
+ * file or shared memory mapping. All internal links are offsets, so the heap
+ * may be mapped at a different address than when it was last used, as long
+ * as the tlsf_t and the arena returned by its backend keep the same
+ * distance. A zero-filled tlsf_t is initialized as a new, empty heap.
+ * Process-local state such as the profiler is cleared.
+ *
+ * @param mem Location of the tlsf_t
+ * @param resize Backend of the heap in this process, used to locate the
+ *        arena, NULL for the global tlsf_resize()
+ * @param ctx Stored as resize_ctx for the backend
+ * @return The heap, or NULL if @mem does not hold a compatible heap
+ */
+tlsf_t *tlsf_attach(void *mem, tlsf_resize_fn resize, void *ctx);
+#endif
+
+#ifdef TLSF_ENABLE_TRACE
+#ifndef TLSF_TRACE_EVENTS
+#define TLSF_TRACE_EVENTS 256
+#endif
+
+/* Slow-path allocator events. Arena events report the new arena size and
+ * the number of bytes added or removed.
+ */
+enum {
+    TLSF_TRACE_GROW,     /* addr: arena */
+    TLSF_TRACE_SHRINK,   /* addr: new sentinel */
+    TLSF_TRACE_APPEND,   /* addr: appended pool */
+    TLSF_TRACE_RELOCATE, /* addr: new payload, size: new size, arg: old one */
+    TLSF_TRACE_FAIL,     /* size: block size which could not be allocated */
+};
+
+typedef struct {
+    uint64_t seq;  /* event number, starting at 1 */
+    uint64_t time; /* CLOCK_MONOTONIC in nanoseconds */
+    const tlsf_t *heap;
+    const void *addr;
+    size_t size, arg;
+    uint32_t event;
+} tlsf_trace_t;
+
+/**
+ * Copy the most recent events of all heaps from the process-wide ring,
+ * oldest first. Recording is lock-free, so events which are overwritten
+ * while being copied are skipped.
+ *
+ * @param max Capacity of @out, at most TLSF_TRACE_EVENTS are returned
+ * @return Number of events written to @out
+ */
+size_t tlsf_trace_snapshot(tlsf_trace_t *out, size_t max);
+#endif
+
 #ifdef TLSF_ENABLE_CHECK
 void tlsf_check(tlsf_t *);
 #else
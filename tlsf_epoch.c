@@ -0,0 +1,235 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tlsf_epoch.h"
+
+/* Blocks per batch. A batch is allocated from the heap itself. */
+#define EPOCH_BATCH 64
+
+struct tlsf_epoch_batch {
+    struct tlsf_epoch_batch *next;
+    uint64_t epoch;
+    size_t count;
+    void *ptr[EPOCH_BATCH];
+};
+
+static void heap_lock(tlsf_epoch_t *e)
+{
+    if (e->lock)
+        pthread_mutex_lock(e->lock);
+}
+
+static void heap_unlock(tlsf_epoch_t *e)
+{
+    if (e->lock)
+        pthread_mutex_unlock(e->lock);
+}
+
+/* Oldest epoch in which a reader other than @self is active. Blocks of a
+ * batch stamped with an earlier epoch cannot be referenced anymore.
+ */
+static uint64_t epoch_min(tlsf_epoch_t *e, const tlsf_epoch_slot_t *self)
+{
+    uint64_t min = UINT64_MAX;
+    unsigned count = __atomic_load_n(&e->count, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t active = __atomic_load_n(&e->slot[i].active, __ATOMIC_ACQUIRE);
+        if (active && active < min && &e->slot[i] != self)
+            min = active;
+    }
+    return min;
+}
+
+/* Stamp the open batch with the current epoch and start a new one. Readers
+ * entering from now on see the next epoch, and no retired block.
+ */
+static void epoch_seal(tlsf_epoch_t *e, tlsf_epoch_slot_t *s)
+{
+    struct tlsf_epoch_batch *b = s->open;
+    if (!b || !b->count)
+        return;
+    b->epoch = __atomic_fetch_add(&e->epoch, 1, __ATOMIC_SEQ_CST);
+    b->next = s->sealed;
+    s->sealed = b;
+    s->open = NULL;
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) *(void *const *) a;
+    uintptr_t y = (uintptr_t) *(void *const *) b;
+    return (x > y) - (x < y);
+}
+
+/* Free the blocks of a list of batches, and the batches themselves. */
+static size_t epoch_release(tlsf_epoch_t *e, struct tlsf_epoch_batch *b)
+{
+    size_t freed = 0;
+    if (!b)
+        return 0;
+    for (struct tlsf_epoch_batch *i = b; i; i = i->next)
+        qsort(i->ptr, i->count, sizeof(void *), ptr_cmp);
+
+    heap_lock(e);
+    while (b) {
+        struct tlsf_epoch_batch *next = b->next;
+        for (size_t i = 0; i < b->count; i++)
+            tlsf_free(e->heap, b->ptr[i]);
+        freed += b->count;
+        tlsf_free(e->heap, b);
+        b = next;
+    }
+    heap_unlock(e);
+    return freed;
+}
+
+/* Hand a list of sealed batches over to the domain. */
+static void orphans_push(tlsf_epoch_t *e, struct tlsf_epoch_batch *b)
+{
+    if (!b)
+        return;
+    struct tlsf_epoch_batch *tail = b;
+    while (tail->next)
+        tail = tail->next;
+    struct tlsf_epoch_batch *head =
+        __atomic_load_n(&e->orphans, __ATOMIC_RELAXED);
+    do
+        tail->next = head;
+    while (!__atomic_compare_exchange_n(&e->orphans, &head, b, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free the orphaned batches which no reader can reference anymore, and give
+ * the others back. The caller may have seen their blocks as well, unlike
+ * its own retired ones.
+ */
+static size_t orphans_reclaim(tlsf_epoch_t *e)
+{
+    if (!__atomic_load_n(&e->orphans, __ATOMIC_RELAXED))
+        return 0;
+    struct tlsf_epoch_batch *b =
+        __atomic_exchange_n(&e->orphans, NULL, __ATOMIC_ACQUIRE);
+    uint64_t min = epoch_min(e, NULL);
+    struct tlsf_epoch_batch *done = NULL, *keep = NULL;
+    while (b) {
+        struct tlsf_epoch_batch *next = b->next;
+        struct tlsf_epoch_batch **list = b->epoch < min ? &done : &keep;
+        b->next = *list;
+        *list = b;
+        b = next;
+    }
+    orphans_push(e, keep);
+    return epoch_release(e, done);
+}
+
+void tlsf_epoch_init(tlsf_epoch_t *e, tlsf_t *heap, pthread_mutex_t *lock)
+{
+    memset(e, 0, sizeof(*e));
+    e->epoch = 1;
+    e->heap = heap;
+    e->lock = lock;
+}
+
+void tlsf_epoch_destroy(tlsf_epoch_t *e)
+{
+    for (unsigned i = 0; i < e->count; i++) {
+        tlsf_epoch_slot_t *s = &e->slot[i];
+        epoch_seal(e, s);
+        if (s->open) {
+            s->open->next = s->sealed;
+            s->sealed = s->open;
+        }
+        epoch_release(e, s->sealed);
+    }
+    epoch_release(e, e->orphans);
+    e->orphans = NULL;
+    memset(e->slot, 0, sizeof(e->slot));
+    e->count = 0;
+}
+
+tlsf_epoch_slot_t *tlsf_epoch_register(tlsf_epoch_t *e)
+{
+    for (unsigned i = 0; i < TLSF_EPOCH_MAX_THREADS; i++) {
+        uint32_t unused = 0;
+        if (!__atomic_compare_exchange_n(&e->slot[i].used, &unused, 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        /* Readers are only looked for in the first count slots. */
+        unsigned count = __atomic_load_n(&e->count, __ATOMIC_RELAXED);
+        while (count <= i &&
+               !__atomic_compare_exchange_n(&e->count, &count, i + 1, true,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED))
+            ;
+        return &e->slot[i];
+    }
+    return NULL;
+}
+
+void tlsf_epoch_unregister(tlsf_epoch_t *e, tlsf_epoch_slot_t *s)
+{
+    epoch_seal(e, s);
+    if (s->open) {
+        /* Sealing leaves an empty batch open. */
+        heap_lock(e);
+        tlsf_free(e->heap, s->open);
+        heap_unlock(e);
+        s->open = NULL;
+    }
+    tlsf_epoch_reclaim(e, s);
+    orphans_push(e, s->sealed);
+    s->sealed = NULL;
+    __atomic_store_n(&s->used, 0, __ATOMIC_RELEASE);
+}
+
+size_t tlsf_epoch_reclaim(tlsf_epoch_t *e, tlsf_epoch_slot_t *s)
+{
+    epoch_seal(e, s);
+
+    /* Sealed batches are newest first, so once one is old enough, so are all
+     * that follow. The blocks retired by the caller itself do not wait for
+     * its own section, it gave them up already.
+     */
+    uint64_t min = epoch_min(e, s);
+    struct tlsf_epoch_batch **link = &s->sealed;
+    while (*link && (*link)->epoch >= min)
+        link = &(*link)->next;
+    struct tlsf_epoch_batch *done = *link;
+    *link = NULL;
+    return epoch_release(e, done) + orphans_reclaim(e);
+}
+
+void tlsf_epoch_retire(tlsf_epoch_t *e, tlsf_epoch_slot_t *s, void *ptr)
+{
+    struct tlsf_epoch_batch *b = s->open;
+    if (!b) {
+        heap_lock(e);
+        b = (struct tlsf_epoch_batch *) tlsf_malloc(e->heap, sizeof(*b));
+        heap_unlock(e);
+        if (!b) {
+            /* Wait for every reader but the caller, which gave the block up
+             * already, to leave the sections it may have been seen in.
+             */
+            uint64_t epoch = __atomic_fetch_add(&e->epoch, 1, __ATOMIC_SEQ_CST);
+            while (epoch_min(e, s) <= epoch)
+                sched_yield();
+            heap_lock(e);
+            tlsf_free(e->heap, ptr);
+            heap_unlock(e);
+            return;
+        }
+        b->count = 0;
+        s->open = b;
+    }
+
+    b->ptr[b->count++] = ptr;
+    if (b->count == EPOCH_BATCH)
+        tlsf_epoch_reclaim(e, s);
+}
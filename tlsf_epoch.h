@@ -0,0 +1,123 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include "tlsf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#ifndef TLSF_EPOCH_MAX_THREADS
+#define TLSF_EPOCH_MAX_THREADS 64
+#endif
+
+/* Per-thread state of an epoch domain. active is the epoch in which the
+ * thread entered its current critical section, 0 outside of one. used is
+ * set while a thread owns the slot. The batches are only used by the owner.
+ */
+typedef struct {
+    uint64_t active;
+    uint32_t used;
+    struct tlsf_epoch_batch *open, *sealed;
+} __attribute__((aligned(64))) tlsf_epoch_slot_t;
+
+/* Epoch-based deferred free for lock-free data structures. Readers access
+ * shared blocks between tlsf_epoch_enter() and tlsf_epoch_exit(). Writers
+ * unlink a block and retire it instead of freeing it. Retired blocks are
+ * collected in per-thread batches, each stamped with the global epoch when
+ * it fills up, and a batch is freed once every reader has entered a later
+ * epoch, so no reader can still hold one of its blocks.
+ *
+ * A thread registers before its first use of the domain and unregisters
+ * before it exits. Its slot is then reused by the next thread to register,
+ * and the batches it still holds are passed on to the domain, whose orphans
+ * are freed by the next tlsf_epoch_reclaim() of any thread once safe.
+ *
+ * The heap is only accessed with @lock held (if any), which must also guard
+ * all other uses of the heap. A batch is freed with a single acquisition of
+ * the lock, in address order, so that neighbouring blocks coalesce in turn.
+ */
+typedef struct {
+    uint64_t epoch;
+    tlsf_t *heap;
+    pthread_mutex_t *lock;
+    unsigned count; /* slots ever used */
+    struct tlsf_epoch_batch *orphans;
+    tlsf_epoch_slot_t slot[TLSF_EPOCH_MAX_THREADS];
+} tlsf_epoch_t;
+
+/**
+ * Create an epoch domain whose retired blocks are freed to @heap.
+ *
+ * @param lock Mutex serializing the uses of @heap, NULL if it is only used
+ *             by a single thread
+ */
+void tlsf_epoch_init(tlsf_epoch_t *, tlsf_t *heap, pthread_mutex_t *lock);
+
+/**
+ * Free all retired blocks, including those of threads which did not
+ * unregister. No thread may use the domain anymore.
+ */
+void tlsf_epoch_destroy(tlsf_epoch_t *);
+
+/**
+ * Register the calling thread, which passes the returned slot to all other
+ * calls on the domain.
+ *
+ * @return The slot of the thread, or NULL if all slots are taken
+ */
+tlsf_epoch_slot_t *tlsf_epoch_register(tlsf_epoch_t *);
+
+/**
+ * Give up the slot of the calling thread, outside of a critical section.
+ * Its retired blocks which are not yet safe to free are left to the domain.
+ */
+void tlsf_epoch_unregister(tlsf_epoch_t *, tlsf_epoch_slot_t *);
+
+/**
+ * Enter a critical section, in which blocks reached through shared links
+ * stay valid even if another thread retires them. Sections do not nest.
+ */
+static inline void tlsf_epoch_enter(tlsf_epoch_t *e, tlsf_epoch_slot_t *s)
+{
+    __atomic_store_n(&s->active, __atomic_load_n(&e->epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Leave the critical section. Blocks read in it must not be used anymore.
+ */
+static inline void tlsf_epoch_exit(tlsf_epoch_t *e, tlsf_epoch_slot_t *s)
+{
+    (void) e;
+    __atomic_store_n(&s->active, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Free a block allocated from the heap of the domain once no reader can
+ * reference it anymore. The block must already be unlinked from all shared
+ * structures, and the caller must not access it afterwards.
+ *
+ * If no memory is left for the batch, waits until all readers have left
+ * their critical sections and frees the block right away.
+ */
+void tlsf_epoch_retire(tlsf_epoch_t *, tlsf_epoch_slot_t *, void *ptr);
+
+/**
+ * Free the blocks retired by the calling thread, and those left by threads
+ * which unregistered, which no reader can reference anymore, e.g. from an
+ * idle hook. Retiring does so as well whenever a batch fills up.
+ *
+ * @return Number of blocks freed
+ */
+size_t tlsf_epoch_reclaim(tlsf_epoch_t *, tlsf_epoch_slot_t *);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,163 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "tlsf_index.h"
+#include "tlsf_internal.h"
+
+/* Levels of the bitmap, enough for 2^48 granules */
+#define INDEX_LEVELS 8
+
+/* Level 0 has a bit per granule of the arena, set at the payload of every
+ * used block. Bit i of level l+1 is set if word i of level l is non-zero.
+ * The top level is a single word.
+ */
+struct tlsf_index {
+    char *base;
+    size_t bytes, bits;
+    size_t map_size;
+    unsigned levels;
+    uint64_t *level[INDEX_LEVELS];
+};
+
+static size_t index_bit(const struct tlsf_index *x, const void *ptr)
+{
+    return (size_t) ((const char *) ptr - x->base) >> _TLSF_ALIGN_SHIFT;
+}
+
+static void index_set(struct tlsf_index *x, size_t bit)
+{
+    for (unsigned l = 0; l < x->levels; l++, bit /= 64) {
+        uint64_t *w = &x->level[l][bit / 64], old = *w;
+        *w = old | (uint64_t) 1 << (bit % 64);
+        if (old)
+            break;
+    }
+}
+
+static void index_clear(struct tlsf_index *x, size_t bit)
+{
+    for (unsigned l = 0; l < x->levels; l++, bit /= 64) {
+        uint64_t *w = &x->level[l][bit / 64];
+        *w &= ~((uint64_t) 1 << (bit % 64));
+        if (*w)
+            break;
+    }
+}
+
+/* Find the highest set bit of level 0 at or below @bit. Climb until a level
+ * has a set bit at or below the word being searched, then descend along the
+ * highest set bits.
+ */
+static bool index_prev(const struct tlsf_index *x, size_t bit, size_t *found)
+{
+    unsigned l = 0;
+    for (;; l++) {
+        uint64_t w = x->level[l][bit / 64] & (~(uint64_t) 0 >> (63 - bit % 64));
+        if (w) {
+            bit = bit / 64 * 64 + 63 - (size_t) __builtin_clzll(w);
+            break;
+        }
+        if (bit < 64 || l + 1 == x->levels)
+            return false;
+        bit = bit / 64 - 1;
+    }
+    while (l--)
+        bit = bit * 64 + 63 - (size_t) __builtin_clzll(x->level[l][bit]);
+    *found = bit;
+    return true;
+}
+
+void tlsf_index_move(tlsf_t *t, void *base)
+{
+    t->index->base = (char *) base;
+}
+
+void tlsf_index_set(tlsf_t *t, const void *ptr)
+{
+    index_set(t->index, index_bit(t->index, ptr));
+}
+
+void tlsf_index_clear(tlsf_t *t, const void *ptr)
+{
+    index_clear(t->index, index_bit(t->index, ptr));
+}
+
+void tlsf_index_release(tlsf_t *t, const void *ptr)
+{
+    struct tlsf_index *x = t->index;
+    size_t first = index_bit(x, ptr), bit;
+    if (!first) {
+        madvise(x->level[0], x->map_size, MADV_DONTNEED);
+        return;
+    }
+    while (index_prev(x, x->bits - 1, &bit) && bit >= first)
+        index_clear(x, bit);
+}
+
+void *tlsf_index_find(const tlsf_t *t, const void *addr)
+{
+    const struct tlsf_index *x = t->index;
+    size_t off = (size_t) ((const char *) addr - x->base), bit;
+    if ((const char *) addr < x->base || off >= x->bytes ||
+        !index_prev(x, off >> _TLSF_ALIGN_SHIFT, &bit))
+        return NULL;
+    return x->base + (bit << _TLSF_ALIGN_SHIFT);
+}
+
+int tlsf_index_init(tlsf_t *t, size_t reserve)
+{
+    tlsf_index_destroy(t);
+    if (t->size || !reserve)
+        return -1;
+
+    struct tlsf_index *x =
+        (struct tlsf_index *) calloc(1, sizeof(struct tlsf_index));
+    if (!x)
+        return -1;
+    x->bytes = reserve;
+    x->bits = (reserve + (1U << _TLSF_ALIGN_SHIFT) - 1) >> _TLSF_ALIGN_SHIFT;
+
+    size_t words[INDEX_LEVELS], total = 0;
+    for (size_t bits = x->bits;; bits = words[x->levels - 1]) {
+        if (x->levels == INDEX_LEVELS) {
+            free(x);
+            return -1;
+        }
+        words[x->levels] = (bits + 63) / 64;
+        total += words[x->levels++];
+        if (bits <= 64)
+            break;
+    }
+
+    x->map_size = total * sizeof(uint64_t);
+    void *map = mmap(0, x->map_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        free(x);
+        return -1;
+    }
+    x->level[0] = (uint64_t *) map;
+    for (unsigned l = 1; l < x->levels; l++)
+        x->level[l] = x->level[l - 1] + words[l - 1];
+
+    t->index = x;
+    t->index_max = reserve;
+    return 0;
+}
+
+void tlsf_index_destroy(tlsf_t *t)
+{
+    struct tlsf_index *x = t->index;
+    if (x) {
+        munmap(x->level[0], x->map_size);
+        free(x);
+    }
+    t->index = NULL;
+    t->index_max = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#ifndef TLSF_ENABLE_INDEX
+#error "tlsf_index requires TLSF_ENABLE_INDEX"
+#endif
+
+#include "tlsf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Interior-pointer index, which maps any address in the arena to the used
+ * block containing it for tlsf_find_block(), e.g. for conservative garbage
+ * collection or crash-dump tools. The payload of every used block is marked
+ * in a bitmap with one bit per allocation granule, and each level above
+ * tells which words of the level below are non-zero. Finding the nearest
+ * mark below an address takes a few word operations per level, at most
+ * eight levels for any arena.
+ *
+ * The bitmap is reserved for the largest arena up front, about 1/64 of its
+ * size, and only the parts covering used memory are touched. Page
+ * allocations (tlsf_pages.c) are not indexed. Both tlsf_check() and
+ * tlsf_check_step() verify that exactly the used blocks are marked.
+ */
+
+/**
+ * Index the arena of @t, which must be empty, and keep it from growing
+ * beyond @reserve bytes.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int tlsf_index_init(tlsf_t *, size_t reserve);
+
+/**
+ * Release the index.
+ */
+void tlsf_index_destroy(tlsf_t *);
+
+#ifdef __cplusplus
+}
+#endif
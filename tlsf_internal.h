@@ -0,0 +1,50 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+/* Interface between the allocator and its optional modules, not part of the
+ * public API.
+ */
+
+#include "tlsf.h"
+
+#ifdef TLSF_ENABLE_PROFILE
+/* Hooks called by the allocator, implemented by tlsf_prof.c.
+ * tlsf_prof_sample() runs whenever prof_countdown drops below zero, it must
+ * rearm the countdown and returns whether the block was recorded. The other
+ * hooks only run for recorded blocks, except tlsf_prof_reset(), which drops
+ * all of them when the heap is reset.
+ */
+bool tlsf_prof_sample(tlsf_t *, void *ptr, size_t size);
+void tlsf_prof_release(tlsf_t *, void *ptr);
+void tlsf_prof_reset(tlsf_t *);
+void tlsf_prof_move(tlsf_t *, void *from, void *to);
+#endif
+
+#ifdef TLSF_ENABLE_PAGES
+/* Hooks called by the allocator if the heap has pages, implemented by
+ * tlsf_pages.c. tlsf_pages_alloc() returns NULL if the request cannot be
+ * served by pages, tlsf_pages_size() the size of the page allocation at @ptr
+ * or 0 if @ptr is not in the page region.
+ */
+void *tlsf_pages_alloc(tlsf_t *, size_t align, size_t size);
+size_t tlsf_pages_size(const tlsf_t *, const void *ptr);
+void tlsf_pages_free(tlsf_t *, void *ptr);
+void tlsf_pages_reset(tlsf_t *);
+#endif
+
+#ifdef TLSF_ENABLE_INDEX
+/* Hooks called by the allocator if the heap has an index, implemented by
+ * tlsf_index.c. Used blocks are marked by their payload, relative to the
+ * arena start last passed to tlsf_index_move(). tlsf_index_release() drops
+ * the marks from @ptr on, tlsf_index_find() returns the highest mark at or
+ * below @addr, or NULL.
+ */
+void tlsf_index_move(tlsf_t *, void *base);
+void tlsf_index_set(tlsf_t *, const void *ptr);
+void tlsf_index_clear(tlsf_t *, const void *ptr);
+void tlsf_index_release(tlsf_t *, const void *ptr);
+void *tlsf_index_find(const tlsf_t *, const void *addr);
+#endif
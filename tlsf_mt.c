@@ -0,0 +1,211 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "tlsf_mt.h"
+
+/* Arena preferred by the calling thread plus one, 0 until first used. */
+static __thread unsigned mt_home;
+static unsigned mt_threads;
+
+static unsigned mt_home_arena(const tlsf_mt_t *m)
+{
+    if (!mt_home)
+        mt_home = __atomic_add_fetch(&mt_threads, 1, __ATOMIC_RELAXED);
+    return (mt_home - 1) % m->count;
+}
+
+static void *mt_resize(tlsf_t *t, size_t size)
+{
+    tlsf_mt_arena_t *a =
+        (tlsf_mt_arena_t *) ((char *) t - offsetof(tlsf_mt_arena_t, tlsf));
+    if (size > a->reserve)
+        return NULL;
+
+    /* Give pages released by the heap back to the system. */
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t keep = (size + page - 1) & ~(page - 1);
+    if (keep < a->committed)
+        madvise(a->base + keep, a->committed - keep, MADV_DONTNEED);
+    a->committed = keep;
+    return a->base;
+}
+
+/* Free the blocks other threads deferred to us. The list is detached as a
+ * whole, so pushes never race with removals (no ABA problem).
+ */
+static void mt_drain(tlsf_mt_arena_t *a)
+{
+    void *p = __atomic_exchange_n(&a->deferred, NULL, __ATOMIC_ACQUIRE);
+    while (p) {
+        void *next = *(void **) p;
+        tlsf_free(&a->tlsf, p);
+        p = next;
+    }
+}
+
+static void mt_lock(tlsf_mt_arena_t *a)
+{
+    pthread_mutex_lock(&a->lock);
+    mt_drain(a);
+}
+
+static bool mt_trylock(tlsf_mt_arena_t *a)
+{
+    if (pthread_mutex_trylock(&a->lock))
+        return false;
+    mt_drain(a);
+    return true;
+}
+
+static void mt_unlock(tlsf_mt_arena_t *a)
+{
+    pthread_mutex_unlock(&a->lock);
+}
+
+static tlsf_mt_arena_t *mt_owner(tlsf_mt_t *m, const void *ptr)
+{
+    size_t off = (size_t) ((const char *) ptr - m->base);
+    if ((const char *) ptr < m->base || off / m->reserve >= m->count)
+        return NULL;
+    return &m->arena[off / m->reserve];
+}
+
+int tlsf_mt_init(tlsf_mt_t *m, unsigned arenas, size_t reserve)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    if (!arenas) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        arenas = cpus > 0 ? (unsigned) cpus : 1;
+    }
+    if (arenas > TLSF_MT_MAX_ARENAS)
+        arenas = TLSF_MT_MAX_ARENAS;
+
+    memset(m, 0, sizeof(*m));
+    reserve = (reserve + page - 1) & ~(page - 1);
+    if (!reserve)
+        return -1;
+    void *base = mmap(0, arenas * reserve, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    m->base = (char *) base;
+    m->reserve = reserve;
+
+    for (unsigned i = 0; i < arenas; i++) {
+        tlsf_mt_arena_t *a = &m->arena[i];
+        if (pthread_mutex_init(&a->lock, NULL)) {
+            while (i--)
+                pthread_mutex_destroy(&m->arena[i].lock);
+            munmap(m->base, arenas * reserve);
+            memset(m, 0, sizeof(*m));
+            return -1;
+        }
+        a->tlsf = TLSF_INIT;
+        a->tlsf.resize = mt_resize;
+        a->base = m->base + i * reserve;
+        a->reserve = reserve;
+        m->count = i + 1;
+    }
+    return 0;
+}
+
+void tlsf_mt_destroy(tlsf_mt_t *m)
+{
+    for (unsigned i = 0; i < m->count; i++)
+        pthread_mutex_destroy(&m->arena[i].lock);
+    if (m->base)
+        munmap(m->base, m->count * m->reserve);
+    memset(m, 0, sizeof(*m));
+}
+
+static void *mt_alloc_unlock(tlsf_mt_arena_t *a, size_t align, size_t size)
+{
+    void *p = align ? tlsf_aalloc(&a->tlsf, align, size)
+                    : tlsf_malloc(&a->tlsf, size);
+    mt_unlock(a);
+    return p;
+}
+
+/* Try the home arena and then every other one without blocking. A thread
+ * which finds its home contended adopts the arena it succeeded on, which
+ * spreads colliding threads over the arenas. Only if all arenas are busy
+ * (or full) does it wait for them.
+ */
+static void *mt_alloc(tlsf_mt_t *m, size_t align, size_t size)
+{
+    unsigned home = mt_home_arena(m);
+    for (unsigned i = 0; i < m->count; i++) {
+        unsigned k = (home + i) % m->count;
+        if (!mt_trylock(&m->arena[k]))
+            continue;
+        void *p = mt_alloc_unlock(&m->arena[k], align, size);
+        if (p) {
+            mt_home = k + 1;
+            return p;
+        }
+    }
+    for (unsigned i = 0; i < m->count; i++) {
+        tlsf_mt_arena_t *a = &m->arena[(home + i) % m->count];
+        mt_lock(a);
+        void *p = mt_alloc_unlock(a, align, size);
+        if (p)
+            return p;
+    }
+    return NULL;
+}
+
+void *tlsf_mt_malloc(tlsf_mt_t *m, size_t size)
+{
+    return mt_alloc(m, 0, size);
+}
+
+void *tlsf_mt_aalloc(tlsf_mt_t *m, size_t align, size_t size)
+{
+    return align ? mt_alloc(m, align, size) : NULL;
+}
+
+void *tlsf_mt_realloc(tlsf_mt_t *m, void *mem, size_t size)
+{
+    if (!mem)
+        return tlsf_mt_malloc(m, size);
+
+    tlsf_mt_arena_t *a = mt_owner(m, mem);
+    if (!a)
+        return NULL;
+    mt_lock(a);
+    void *p = tlsf_realloc(&a->tlsf, mem, size);
+    mt_unlock(a);
+    return p;
+}
+
+void tlsf_mt_free(tlsf_mt_t *m, void *mem)
+{
+    tlsf_mt_arena_t *a = mem ? mt_owner(m, mem) : NULL;
+    if (!a)
+        return;
+    if (mt_trylock(a)) {
+        tlsf_free(&a->tlsf, mem);
+        mt_unlock(a);
+        return;
+    }
+
+    /* The owner is busy, leave the block to the thread holding the lock. */
+    void *head = __atomic_load_n(&a->deferred, __ATOMIC_RELAXED);
+    do {
+        *(void **) mem = head;
+    } while (!__atomic_compare_exchange_n(&a->deferred, &head, mem, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void tlsf_mt_flush(tlsf_mt_t *m)
+{
+    for (unsigned i = 0; i < m->count; i++) {
+        mt_lock(&m->arena[i]);
+        mt_unlock(&m->arena[i]);
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include "tlsf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#ifndef TLSF_MT_MAX_ARENAS
+#define TLSF_MT_MAX_ARENAS 64
+#endif
+
+/* One stripe of a concurrent heap. Blocks freed while the arena is locked
+ * by another thread are pushed onto a lock-free list and freed by the next
+ * thread holding the lock.
+ */
+typedef struct {
+    tlsf_t tlsf;
+    pthread_mutex_t lock;
+    void *deferred;
+    char *base;
+    size_t reserve, committed;
+} __attribute__((aligned(64))) tlsf_mt_arena_t;
+
+/* Thread-safe heap made of independently locked TLSF arenas. Each thread
+ * allocates from its home arena and moves to another one when its home is
+ * contended, so uncontended threads never share a lock. Frees go to the
+ * arena owning the block, found from its address, without ever waiting.
+ */
+typedef struct {
+    unsigned count;
+    size_t reserve;
+    char *base;
+    tlsf_mt_arena_t arena[TLSF_MT_MAX_ARENAS];
+} tlsf_mt_t;
+
+/**
+ * Create @arenas arenas, each reserving @reserve bytes of address space.
+ *
+ * @param arenas Number of arenas, 0 for one per online CPU
+ * @return 0 on success, -1 on failure
+ */
+int tlsf_mt_init(tlsf_mt_t *, unsigned arenas, size_t reserve);
+
+/**
+ * Release all arenas. Outstanding allocations become invalid.
+ */
+void tlsf_mt_destroy(tlsf_mt_t *);
+
+/* Thread-safe allocation functions. */
+void *tlsf_mt_malloc(tlsf_mt_t *, size_t size);
+void *tlsf_mt_aalloc(tlsf_mt_t *, size_t align, size_t size);
+void *tlsf_mt_realloc(tlsf_mt_t *, void *, size_t);
+void tlsf_mt_free(tlsf_mt_t *, void *);
+
+/**
+ * Complete the deferred frees of all arenas, e.g. from an idle hook, so that
+ * their memory can be returned to the system.
+ */
+void tlsf_mt_flush(tlsf_mt_t *);
+
+#ifdef __cplusplus
+}
+#endif
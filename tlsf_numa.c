@@ -0,0 +1,209 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tlsf_numa.h"
+
+/* From <linux/mempolicy.h>, to avoid depending on libnuma. */
+#define MPOL_PREFERRED 1
+#define NODEMASK_LONGS 16
+
+/* Parse the online node list, e.g. "0-1,4". Without NUMA support in the
+ * kernel the list is missing, which is treated as a single node 0.
+ */
+static unsigned numa_online_nodes(int *nodes)
+{
+    unsigned count = 0;
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f) {
+        int lo, hi;
+        while (count < TLSF_NUMA_MAX_NODES && fscanf(f, "%d", &lo) == 1) {
+            hi = lo;
+            int c = fgetc(f);
+            if (c == '-') {
+                if (fscanf(f, "%d", &hi) != 1)
+                    break;
+                c = fgetc(f);
+            }
+            for (int node = lo; node <= hi && count < TLSF_NUMA_MAX_NODES;
+                 node++)
+                nodes[count++] = node;
+            if (c != ',')
+                break;
+        }
+        fclose(f);
+    }
+    if (!count)
+        nodes[count++] = 0;
+    return count;
+}
+
+static int numa_current_node(void)
+{
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL))
+        return -1;
+    return (int) node;
+}
+
+/* Place the pages of a range on @node once they are first touched. The
+ * policy is only preferred, so a full node spills over instead of failing
+ * the page fault. Errors are ignored, since placement is merely a hint.
+ */
+static void numa_bind(char *addr, size_t len, int node)
+{
+    unsigned long mask[NODEMASK_LONGS] = {0};
+    const unsigned bits = 8 * sizeof(unsigned long);
+    if (node < 0 || (unsigned) node >= NODEMASK_LONGS * bits)
+        return;
+    mask[(unsigned) node / bits] = 1UL << ((unsigned) node % bits);
+    syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+            NODEMASK_LONGS * bits + 1, 0);
+}
+
+static void *numa_resize(tlsf_t *t, size_t size)
+{
+    tlsf_numa_arena_t *a =
+        (tlsf_numa_arena_t *) ((char *) t - offsetof(tlsf_numa_arena_t, tlsf));
+    if (size > a->reserve)
+        return NULL;
+
+    /* Give pages released by the heap back to the system. */
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t keep = (size + page - 1) & ~(page - 1);
+    if (keep < a->committed)
+        madvise(a->base + keep, a->committed - keep, MADV_DONTNEED);
+    a->committed = keep;
+    return a->base;
+}
+
+int tlsf_numa_init(tlsf_numa_t *n, size_t reserve)
+{
+    int nodes[TLSF_NUMA_MAX_NODES];
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    unsigned count = numa_online_nodes(nodes);
+
+    memset(n, 0, sizeof(*n));
+    reserve = (reserve + page - 1) & ~(page - 1);
+    for (unsigned i = 0; i < count; i++) {
+        tlsf_numa_arena_t *a = &n->arena[i];
+        void *base = mmap(0, reserve, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            goto fail;
+        if (pthread_mutex_init(&a->lock, NULL)) {
+            munmap(base, reserve);
+            goto fail;
+        }
+        a->tlsf = TLSF_INIT;
+        a->tlsf.resize = numa_resize;
+        a->base = (char *) base;
+        a->reserve = reserve;
+        a->node = nodes[i];
+        if (count > 1)
+            numa_bind(a->base, reserve, a->node);
+        n->count = i + 1;
+    }
+    return 0;
+
+fail:
+    tlsf_numa_destroy(n);
+    return -1;
+}
+
+void tlsf_numa_destroy(tlsf_numa_t *n)
+{
+    for (unsigned i = 0; i < n->count; i++) {
+        munmap(n->arena[i].base, n->arena[i].reserve);
+        pthread_mutex_destroy(&n->arena[i].lock);
+    }
+    n->count = 0;
+}
+
+static int numa_owner(const tlsf_numa_t *n, const void *ptr)
+{
+    for (unsigned i = 0; i < n->count; i++) {
+        const tlsf_numa_arena_t *a = &n->arena[i];
+        if ((const char *) ptr >= a->base &&
+            (size_t) ((const char *) ptr - a->base) < a->reserve)
+            return (int) i;
+    }
+    return -1;
+}
+
+static void *arena_alloc(tlsf_numa_arena_t *a, size_t align, size_t size)
+{
+    pthread_mutex_lock(&a->lock);
+    void *p = align ? tlsf_aalloc(&a->tlsf, align, size)
+                    : tlsf_malloc(&a->tlsf, size);
+    pthread_mutex_unlock(&a->lock);
+    return p;
+}
+
+/* Allocate on the local node, spilling to remote nodes rather than fail. */
+static void *numa_alloc(tlsf_numa_t *n, size_t align, size_t size)
+{
+    tlsf_numa_arena_t *local = &n->arena[0];
+    if (n->count > 1) {
+        int node = numa_current_node();
+        for (unsigned i = 0; i < n->count; i++) {
+            if (n->arena[i].node == node)
+                local = &n->arena[i];
+        }
+    }
+
+    void *p = arena_alloc(local, align, size);
+    for (unsigned i = 0; !p && i < n->count; i++) {
+        if (&n->arena[i] != local)
+            p = arena_alloc(&n->arena[i], align, size);
+    }
+    return p;
+}
+
+void *tlsf_numa_malloc(tlsf_numa_t *n, size_t size)
+{
+    return numa_alloc(n, 0, size);
+}
+
+void *tlsf_numa_aalloc(tlsf_numa_t *n, size_t align, size_t size)
+{
+    return align ? numa_alloc(n, align, size) : NULL;
+}
+
+void *tlsf_numa_realloc(tlsf_numa_t *n, void *mem, size_t size)
+{
+    if (!mem)
+        return tlsf_numa_malloc(n, size);
+
+    int i = numa_owner(n, mem);
+    if (i < 0)
+        return NULL;
+    tlsf_numa_arena_t *a = &n->arena[i];
+    pthread_mutex_lock(&a->lock);
+    void *p = tlsf_realloc(&a->tlsf, mem, size);
+    pthread_mutex_unlock(&a->lock);
+    return p;
+}
+
+void tlsf_numa_free(tlsf_numa_t *n, void *mem)
+{
+    int i = numa_owner(n, mem);
+    if (i < 0)
+        return;
+    tlsf_numa_arena_t *a = &n->arena[i];
+    pthread_mutex_lock(&a->lock);
+    tlsf_free(&a->tlsf, mem);
+    pthread_mutex_unlock(&a->lock);
+}
+
+int tlsf_numa_node_of(const tlsf_numa_t *n, const void *ptr)
+{
+    int i = numa_owner(n, ptr);
+    return i < 0 ? -1 : n->arena[i].node;
+}
@@ -0,0 +1,64 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <pthread.h>
+
+#include "tlsf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#ifndef TLSF_NUMA_MAX_NODES
+#define TLSF_NUMA_MAX_NODES 8
+#endif
+
+/* Arena of a single NUMA node, backed by its own address range. */
+typedef struct {
+    tlsf_t tlsf;
+    pthread_mutex_t lock;
+    char *base;
+    size_t reserve, committed;
+    int node;
+} tlsf_numa_arena_t;
+
+/* One heap per NUMA node. Allocations are served by the arena of the node
+ * the calling thread runs on, frees go back to the arena owning the block.
+ * On single-node machines (or without NUMA support) this degrades to a
+ * single locked arena.
+ */
+typedef struct {
+    unsigned count;
+    tlsf_numa_arena_t arena[TLSF_NUMA_MAX_NODES];
+} tlsf_numa_t;
+
+/**
+ * Create one arena per online node, each reserving @reserve bytes of address
+ * space whose pages are placed on that node.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int tlsf_numa_init(tlsf_numa_t *, size_t reserve);
+
+/**
+ * Release all arenas. Outstanding allocations become invalid.
+ */
+void tlsf_numa_destroy(tlsf_numa_t *);
+
+/* Thread-safe allocation functions. */
+void *tlsf_numa_malloc(tlsf_numa_t *, size_t size);
+void *tlsf_numa_aalloc(tlsf_numa_t *, size_t align, size_t size);
+void *tlsf_numa_realloc(tlsf_numa_t *, void *, size_t);
+void tlsf_numa_free(tlsf_numa_t *, void *);
+
+/**
+ * Return the node whose arena owns @ptr, or -1 if it was not allocated here.
+ */
+int tlsf_numa_node_of(const tlsf_numa_t *, const void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,204 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "tlsf_pages.h"
+#include "tlsf_internal.h"
+
+/* Flag of free runs in the side table, and the null run index. */
+#define RUN_FREE ((uint32_t) 1 << 31)
+#define RUN_NONE UINT32_MAX
+
+/* Longest search of a size class whose runs may be too small */
+#define RUN_WALK 16
+
+/* Released pages may be reclaimed lazily where the kernel supports it. */
+#ifdef MADV_FREE
+#define PAGES_RELEASE MADV_FREE
+#else
+#define PAGES_RELEASE MADV_DONTNEED
+#endif
+
+/* Each run of pages, free or used, has its length in pages (and RUN_FREE)
+ * at the entries of its first and last page in map, so that both neighbours
+ * of a run are found in constant time. Free runs are linked through next and
+ * prev at their first page, into lists of runs of 2^k to 2^(k+1)-1 pages.
+ */
+struct tlsf_pages {
+    char *base;
+    size_t page;
+    uint32_t count, classes;
+    uint32_t head[32];
+    uint32_t *map, *next, *prev;
+};
+
+static uint32_t run_class(uint32_t n)
+{
+    return 31 - (uint32_t) __builtin_clz(n);
+}
+
+static void run_set(struct tlsf_pages *p,
+                    uint32_t first,
+                    uint32_t n,
+                    uint32_t flags)
+{
+    p->map[first] = p->map[first + n - 1] = n | flags;
+}
+
+static void run_insert(struct tlsf_pages *p, uint32_t first, uint32_t n)
+{
+    uint32_t k = run_class(n);
+    run_set(p, first, n, RUN_FREE);
+    p->prev[first] = RUN_NONE;
+    p->next[first] = p->head[k];
+    if (p->head[k] != RUN_NONE)
+        p->prev[p->head[k]] = first;
+    p->head[k] = first;
+    p->classes |= 1U << k;
+}
+
+static void run_remove(struct tlsf_pages *p, uint32_t first)
+{
+    uint32_t k = run_class(p->map[first] & ~RUN_FREE);
+    uint32_t next = p->next[first], prev = p->prev[first];
+    if (next != RUN_NONE)
+        p->prev[next] = prev;
+    if (prev != RUN_NONE)
+        p->next[prev] = next;
+    else if ((p->head[k] = next) == RUN_NONE)
+        p->classes &= ~(1U << k);
+}
+
+/* Find a free run of at least @n pages. Every run of a larger class fits,
+ * otherwise a few runs of the class of @n itself are tried.
+ */
+static uint32_t run_find(const struct tlsf_pages *p, uint32_t n)
+{
+    uint32_t k = run_class(n), above = k + !!(n & (n - 1));
+    uint32_t classes = above < 32 ? p->classes & (~0U << above) : 0;
+    if (classes)
+        return p->head[__builtin_ctz(classes)];
+
+    uint32_t r = p->head[k];
+    for (unsigned i = 0; r != RUN_NONE && i < RUN_WALK; i++, r = p->next[r]) {
+        if ((p->map[r] & ~RUN_FREE) >= n)
+            return r;
+    }
+    return RUN_NONE;
+}
+
+void *tlsf_pages_alloc(tlsf_t *t, size_t align, size_t size)
+{
+    struct tlsf_pages *p = t->pages;
+    if (align > p->page || size > (size_t) p->count * p->page)
+        return NULL;
+
+    uint32_t n = (uint32_t) ((size + p->page - 1) / p->page);
+    uint32_t first = run_find(p, n);
+    if (first == RUN_NONE)
+        return NULL;
+
+    uint32_t len = p->map[first] & ~RUN_FREE;
+    run_remove(p, first);
+    if (len > n)
+        run_insert(p, first + n, len - n);
+    run_set(p, first, n, 0);
+    return p->base + (size_t) first * p->page;
+}
+
+size_t tlsf_pages_size(const tlsf_t *t, const void *ptr)
+{
+    const struct tlsf_pages *p = t->pages;
+    size_t off = (size_t) ((const char *) ptr - p->base);
+    if ((const char *) ptr < p->base || off >= (size_t) p->count * p->page)
+        return 0;
+    return (size_t) (p->map[off / p->page] & ~RUN_FREE) * p->page;
+}
+
+void tlsf_pages_free(tlsf_t *t, void *ptr)
+{
+    struct tlsf_pages *p = t->pages;
+    uint32_t first = (uint32_t) ((size_t) ((char *) ptr - p->base) / p->page);
+    uint32_t n = p->map[first];
+    madvise(ptr, (size_t) n * p->page, PAGES_RELEASE);
+
+    if (first && (p->map[first - 1] & RUN_FREE)) {
+        first -= p->map[first - 1] & ~RUN_FREE;
+        n += p->map[first] & ~RUN_FREE;
+        run_remove(p, first);
+    }
+    uint32_t end = first + n;
+    if (end < p->count && (p->map[end] & RUN_FREE)) {
+        n += p->map[end] & ~RUN_FREE;
+        run_remove(p, end);
+    }
+    run_insert(p, first, n);
+}
+
+static void pages_clear(struct tlsf_pages *p)
+{
+    memset(p->head, 0xff, sizeof(p->head));
+    p->classes = 0;
+    run_insert(p, 0, p->count);
+}
+
+void tlsf_pages_reset(tlsf_t *t)
+{
+    struct tlsf_pages *p = t->pages;
+    if (!p)
+        return;
+    madvise(p->base, (size_t) p->count * p->page, PAGES_RELEASE);
+    pages_clear(p);
+}
+
+int tlsf_pages_init(tlsf_t *t, size_t reserve, size_t threshold)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    tlsf_pages_destroy(t);
+    if (!reserve || reserve / page >= RUN_FREE)
+        return -1;
+
+    struct tlsf_pages *p = (struct tlsf_pages *) calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+    p->page = page;
+    p->count = (uint32_t) (reserve / page);
+    p->map = (uint32_t *) calloc(p->count, sizeof(uint32_t));
+    p->next = (uint32_t *) malloc(p->count * sizeof(uint32_t));
+    p->prev = (uint32_t *) malloc(p->count * sizeof(uint32_t));
+    void *base = p->count ? mmap(0, p->count * page, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                 -1, 0)
+                          : MAP_FAILED;
+    /* Set before the checks, so that destroy unmaps what was mapped. */
+    p->base = base == MAP_FAILED ? NULL : (char *) base;
+    t->pages = p;
+    if (!p->base || !p->map || !p->next || !p->prev) {
+        tlsf_pages_destroy(t);
+        return -1;
+    }
+    t->page_min = threshold > page ? threshold : page;
+    pages_clear(p);
+    return 0;
+}
+
+void tlsf_pages_destroy(tlsf_t *t)
+{
+    struct tlsf_pages *p = t->pages;
+    if (p) {
+        if (p->base)
+            munmap(p->base, (size_t) p->count * p->page);
+        free(p->map);
+        free(p->next);
+        free(p->prev);
+        free(p);
+    }
+    t->pages = NULL;
+    t->page_min = 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#ifndef TLSF_ENABLE_PAGES
+#error "tlsf_pages requires TLSF_ENABLE_PAGES"
+#endif
+
+#include "tlsf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Out-of-band allocation of whole pages for large blocks. The pages come
+ * from a region reserved next to the arena, and their sizes and states are
+ * kept in a side table indexed by page number instead of inline headers.
+ * Payloads are thus exactly page-aligned and a whole number of pages, as
+ * needed for O_DIRECT or registered I/O buffers.
+ *
+ * tlsf_malloc(), tlsf_aalloc() (with an alignment up to the page size) and
+ * tlsf_realloc() use the region for requests of at least the threshold, and
+ * fall back to the arena once it is full. tlsf_free() recognizes page
+ * allocations by their address. Tagged allocations always use the arena,
+ * and tlsf_release() only frees blocks of the arena.
+ *
+ * Free runs of pages are coalesced immediately, kept in power-of-two size
+ * classes, and their memory is returned to the system.
+ */
+
+/**
+ * Reserve @reserve bytes of address space for page allocations of @t.
+ *
+ * @param threshold Smallest request served by pages, at least one page
+ * @return 0 on success, -1 on failure
+ */
+int tlsf_pages_init(tlsf_t *, size_t reserve, size_t threshold);
+
+/**
+ * Release the region. Outstanding page allocations become invalid.
+ */
+void tlsf_pages_destroy(tlsf_t *);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,320 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <execinfo.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tlsf_prof.h"
+#include "tlsf_internal.h"
+
+#define PROF_DEPTH 32
+
+/* Samples taken at one call stack. */
+typedef struct {
+    size_t live_count, live_bytes;
+    size_t alloc_count, alloc_bytes;
+    uint64_t hash;
+    int depth;
+    void *pc[PROF_DEPTH];
+} prof_stack_t;
+
+/* A sampled block which is still allocated. */
+typedef struct {
+    void *ptr; /* NULL marks an empty slot */
+    size_t size, stack;
+} prof_sample_t;
+
+/* The profiler keeps its tables in the system heap, so it never changes the
+ * layout of the heap it observes. Both hash tables use linear probing and
+ * are at most half full.
+ */
+struct tlsf_prof {
+    size_t interval;
+    uint64_t rng;
+    prof_stack_t *stacks;
+    size_t nstacks;
+    size_t *stack_slots; /* index into stacks + 1, 0 if empty */
+    size_t stack_mask;
+    prof_sample_t *samples;
+    size_t nsamples, sample_mask;
+};
+
+static uint64_t prof_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    return x;
+}
+
+/* Distance in bytes to the next sample. The gaps of a Poisson process are
+ * exponentially distributed, which makes every allocated byte equally likely
+ * to be picked regardless of the allocation pattern.
+ */
+static ptrdiff_t prof_next(struct tlsf_prof *p)
+{
+    p->rng ^= p->rng << 13;
+    p->rng ^= p->rng >> 7;
+    p->rng ^= p->rng << 17;
+    double u = ((double) (p->rng >> 11) + 1) / 9007199254740992.0;
+    double next = -log(u) * (double) p->interval;
+    return next < (double) (PTRDIFF_MAX / 2) ? (ptrdiff_t) next + 1
+                                             : PTRDIFF_MAX / 2;
+}
+
+static prof_sample_t *sample_slot(const struct tlsf_prof *p, const void *ptr)
+{
+    size_t i = prof_mix((uintptr_t) ptr) & p->sample_mask;
+    while (p->samples[i].ptr && p->samples[i].ptr != ptr)
+        i = (i + 1) & p->sample_mask;
+    return &p->samples[i];
+}
+
+/* Remove a sample, moving later entries of its probe run into the hole. */
+static void sample_erase(struct tlsf_prof *p, prof_sample_t *s)
+{
+    size_t hole = (size_t) (s - p->samples);
+    for (size_t i = (hole + 1) & p->sample_mask; p->samples[i].ptr;
+         i = (i + 1) & p->sample_mask) {
+        size_t home = prof_mix((uintptr_t) p->samples[i].ptr) & p->sample_mask;
+        if (((i - home) & p->sample_mask) >= ((i - hole) & p->sample_mask)) {
+            p->samples[hole] = p->samples[i];
+            hole = i;
+        }
+    }
+    p->samples[hole].ptr = NULL;
+    p->nsamples--;
+}
+
+static bool samples_grow(struct tlsf_prof *p)
+{
+    size_t cap = 2 * (p->sample_mask + 1);
+    prof_sample_t *old = p->samples, *end = old + p->sample_mask + 1;
+    p->samples = (prof_sample_t *) calloc(cap, sizeof(prof_sample_t));
+    if (!p->samples) {
+        p->samples = old;
+        return false;
+    }
+    p->sample_mask = cap - 1;
+    for (prof_sample_t *s = old; s < end; s++) {
+        if (s->ptr)
+            *sample_slot(p, s->ptr) = *s;
+    }
+    free(old);
+    return true;
+}
+
+static size_t *stack_slot(const struct tlsf_prof *p,
+                          uint64_t hash,
+                          void *const *pc,
+                          int depth)
+{
+    size_t i = hash & p->stack_mask;
+    for (; p->stack_slots[i]; i = (i + 1) & p->stack_mask) {
+        const prof_stack_t *s = &p->stacks[p->stack_slots[i] - 1];
+        if (s->hash == hash && s->depth == depth &&
+            !memcmp(s->pc, pc, (size_t) depth * sizeof(void *)))
+            break;
+    }
+    return &p->stack_slots[i];
+}
+
+static bool stacks_grow(struct tlsf_prof *p)
+{
+    size_t cap = 2 * (p->stack_mask + 1);
+    prof_stack_t *stacks =
+        (prof_stack_t *) realloc(p->stacks, cap / 2 * sizeof(prof_stack_t));
+    if (!stacks)
+        return false;
+    p->stacks = stacks;
+
+    size_t *slots = (size_t *) calloc(cap, sizeof(size_t));
+    if (!slots)
+        return false;
+    free(p->stack_slots);
+    p->stack_slots = slots;
+    p->stack_mask = cap - 1;
+    for (size_t i = 0; i < p->nstacks; i++) {
+        prof_stack_t *s = &p->stacks[i];
+        *stack_slot(p, s->hash, s->pc, s->depth) = i + 1;
+    }
+    return true;
+}
+
+/* Find or add the record of the current call stack. */
+static prof_stack_t *stack_intern(struct tlsf_prof *p)
+{
+    void *pc[PROF_DEPTH + 1];
+    int depth = backtrace(pc, PROF_DEPTH + 1) - 1;
+    if (depth <= 0)
+        return NULL;
+
+    /* Skip our own frame, the allocator remains at the top. */
+    uint64_t hash = 0;
+    for (int i = 1; i <= depth; i++)
+        hash = prof_mix(hash ^ (uintptr_t) pc[i]);
+
+    size_t *slot = stack_slot(p, hash, pc + 1, depth);
+    if (*slot)
+        return &p->stacks[*slot - 1];
+    if (2 * (p->nstacks + 1) > p->stack_mask + 1) {
+        if (!stacks_grow(p))
+            return NULL;
+        slot = stack_slot(p, hash, pc + 1, depth);
+    }
+
+    prof_stack_t *s = &p->stacks[p->nstacks];
+    memset(s, 0, sizeof(*s));
+    s->hash = hash;
+    s->depth = depth;
+    memcpy(s->pc, pc + 1, (size_t) depth * sizeof(void *));
+    *slot = ++p->nstacks;
+    return s;
+}
+
+bool tlsf_prof_sample(tlsf_t *t, void *ptr, size_t size)
+{
+    struct tlsf_prof *p = t->prof;
+    if (!p) {
+        t->prof_countdown = PTRDIFF_MAX;
+        return false;
+    }
+    t->prof_countdown = prof_next(p);
+
+    if (2 * (p->nsamples + 1) > p->sample_mask + 1 && !samples_grow(p))
+        return false;
+    prof_stack_t *s = stack_intern(p);
+    if (!s)
+        return false;
+
+    s->live_count++;
+    s->live_bytes += size;
+    s->alloc_count++;
+    s->alloc_bytes += size;
+    *sample_slot(p, ptr) = (prof_sample_t){
+        .ptr = ptr,
+        .size = size,
+        .stack = (size_t) (s - p->stacks),
+    };
+    p->nsamples++;
+    return true;
+}
+
+void tlsf_prof_release(tlsf_t *t, void *ptr)
+{
+    struct tlsf_prof *p = t->prof;
+    if (!p)
+        return;
+    prof_sample_t *s = sample_slot(p, ptr);
+    if (!s->ptr)
+        return;
+    p->stacks[s->stack].live_count--;
+    p->stacks[s->stack].live_bytes -= s->size;
+    sample_erase(p, s);
+}
+
+void tlsf_prof_move(tlsf_t *t, void *from, void *to)
+{
+    struct tlsf_prof *p = t->prof;
+    if (!p)
+        return;
+    prof_sample_t *s = sample_slot(p, from);
+    if (!s->ptr)
+        return;
+    prof_sample_t moved = *s;
+    moved.ptr = to;
+    sample_erase(p, s);
+    *sample_slot(p, to) = moved;
+    p->nsamples++;
+}
+
+void tlsf_prof_reset(tlsf_t *t)
+{
+    struct tlsf_prof *p = t->prof;
+    if (!p)
+        return;
+    memset(p->samples, 0, (p->sample_mask + 1) * sizeof(prof_sample_t));
+    p->nsamples = 0;
+    for (size_t i = 0; i < p->nstacks; i++)
+        p->stacks[i].live_count = p->stacks[i].live_bytes = 0;
+}
+
+int tlsf_prof_start(tlsf_t *t, size_t interval)
+{
+    tlsf_prof_stop(t);
+
+    struct tlsf_prof *p = (struct tlsf_prof *) calloc(1, sizeof(*p));
+    if (!p)
+        return -1;
+    p->interval = interval ? interval : 1;
+    p->rng = prof_mix((uintptr_t) p) | 1;
+    p->sample_mask = p->stack_mask = 63;
+    p->samples = (prof_sample_t *) calloc(64, sizeof(prof_sample_t));
+    p->stack_slots = (size_t *) calloc(64, sizeof(size_t));
+    p->stacks = (prof_stack_t *) malloc(32 * sizeof(prof_stack_t));
+    if (!p->samples || !p->stack_slots || !p->stacks) {
+        t->prof = p;
+        tlsf_prof_stop(t);
+        return -1;
+    }
+    t->prof = p;
+    t->prof_countdown = prof_next(p);
+    return 0;
+}
+
+void tlsf_prof_stop(tlsf_t *t)
+{
+    struct tlsf_prof *p = t->prof;
+    if (p) {
+        free(p->samples);
+        free(p->stack_slots);
+        free(p->stacks);
+        free(p);
+    }
+    t->prof = NULL;
+    t->prof_countdown = PTRDIFF_MAX;
+}
+
+int tlsf_prof_dump(const tlsf_t *t, FILE *out)
+{
+    const struct tlsf_prof *p = t->prof;
+    if (!p)
+        return -1;
+
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    for (size_t i = 0; i < p->nstacks; i++) {
+        live_count += p->stacks[i].live_count;
+        live_bytes += p->stacks[i].live_bytes;
+        alloc_count += p->stacks[i].alloc_count;
+        alloc_bytes += p->stacks[i].alloc_bytes;
+    }
+
+    /* The counts are raw samples, pprof scales them using the interval. */
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            live_count, live_bytes, alloc_count, alloc_bytes, p->interval);
+    for (size_t i = 0; i < p->nstacks; i++) {
+        const prof_stack_t *s = &p->stacks[i];
+        fprintf(out, "%zu: %zu [%zu: %zu] @", s->live_count, s->live_bytes,
+                s->alloc_count, s->alloc_bytes);
+        for (int j = 0; j < s->depth; j++)
+            fprintf(out, " 0x%" PRIxPTR, (uintptr_t) s->pc[j]);
+        fputc('\n', out);
+    }
+
+    /* Needed by pprof to symbolize the addresses. */
+    fputs("\nMAPPED_LIBRARIES:\n", out);
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)))
+            fwrite(buf, 1, n, out);
+        fclose(maps);
+    }
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#ifndef TLSF_ENABLE_PROFILE
+#error "tlsf_prof requires TLSF_ENABLE_PROFILE"
+#endif
+
+#include <stdio.h>
+
+#include "tlsf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Sampling heap profiler. On average one allocation per @interval bytes is
+ * picked (geometric sampling, as in tcmalloc), its backtrace is recorded and
+ * the block is tracked until it is freed. Unsampled allocations only pay for
+ * a counter decrement in tlsf_malloc().
+ *
+ * The profiler state is private to the process, so heaps shared with other
+ * processes cannot be profiled.
+ */
+
+/**
+ * Start sampling the allocations of @t.
+ *
+ * @param interval Mean number of allocated bytes between two samples
+ * @return 0 on success, -1 if the profiler cannot be allocated
+ */
+int tlsf_prof_start(tlsf_t *, size_t interval);
+
+/**
+ * Stop sampling and drop all samples. Blocks sampled before are released
+ * without being recorded.
+ */
+void tlsf_prof_stop(tlsf_t *);
+
+/**
+ * Write the samples in the text format of gperftools heap profiles
+ * (heap_v2), which pprof reads. Each stack lists the live and the cumulative
+ * allocations, so the dump serves as both the in-use and the allocation
+ * profile (pprof -inuse_space / -alloc_space).
+ *
+ * @return 0 on success, -1 if profiling is not active or writing failed
+ */
+int tlsf_prof_dump(const tlsf_t *, FILE *);
+
+#ifdef __cplusplus
+}
+#endif
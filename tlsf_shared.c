@@ -0,0 +1,139 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "tlsf_shared.h"
+
+/* Offset of the arena from the start of the segment. */
+#define SHARED_ARENA ((sizeof(tlsf_shared_t) + 63) & ~(size_t) 63)
+
+static void *shared_resize(tlsf_t *t, size_t size)
+{
+    tlsf_shared_t *s =
+        (tlsf_shared_t *) ((char *) t - offsetof(tlsf_shared_t, tlsf));
+    return size <= s->capacity ? (char *) s + SHARED_ARENA : NULL;
+}
+
+/* Acquire the heap lock. If its previous owner died while holding it, the
+ * heap is only used again if a full consistency check passes. Otherwise the
+ * lock is left unrecoverable and every later call fails.
+ *
+ * The tlsf_t in the segment holds no process-local state. The backend of
+ * the calling process, whose address differs between processes, is only
+ * installed while it holds the lock.
+ */
+static bool shared_lock(tlsf_shared_t *s)
+{
+    int err = pthread_mutex_lock(&s->lock);
+    if (err && err != EOWNERDEAD)
+        return false;
+    s->tlsf.resize = shared_resize;
+    if (err == EOWNERDEAD) {
+        tlsf_t *t = &s->tlsf;
+        size_t budget = t->size / (2 * sizeof(size_t)) +
+                        _TLSF_FL_COUNT * _TLSF_SL_COUNT;
+
+        /* The cursor may point into a half-updated block. */
+        t->check_block = 0;
+        if (!tlsf_check_step(t, budget) ||
+            pthread_mutex_consistent(&s->lock)) {
+            t->resize = NULL;
+            pthread_mutex_unlock(&s->lock);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void shared_unlock(tlsf_shared_t *s)
+{
+    s->tlsf.resize = NULL;
+    pthread_mutex_unlock(&s->lock);
+}
+
+tlsf_shared_t *tlsf_shared_init(void *mem, size_t size)
+{
+    tlsf_shared_t *s = (tlsf_shared_t *) mem;
+    if (!s || size <= SHARED_ARENA)
+        return NULL;
+    s->capacity = 0;
+
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr))
+        return NULL;
+    int err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (!err)
+        err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (!err)
+        err = pthread_mutex_init(&s->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (err)
+        return NULL;
+
+    memset(&s->tlsf, 0, sizeof(s->tlsf));
+    if (!tlsf_attach(&s->tlsf, NULL, NULL)) {
+        pthread_mutex_destroy(&s->lock);
+        return NULL;
+    }
+
+    /* A non-zero capacity marks the segment as initialized. */
+    s->capacity = size - SHARED_ARENA;
+    return s;
+}
+
+tlsf_shared_t *tlsf_shared_attach(void *mem)
+{
+    tlsf_shared_t *s = (tlsf_shared_t *) mem;
+    if (!s || !s->capacity || !shared_lock(s))
+        return NULL;
+    tlsf_t *t = tlsf_attach(&s->tlsf, shared_resize, NULL);
+    shared_unlock(s);
+    return t ? s : NULL;
+}
+
+void tlsf_shared_check(tlsf_shared_t *s)
+{
+    if (!shared_lock(s))
+        return;
+    tlsf_check(&s->tlsf);
+    shared_unlock(s);
+}
+
+void *tlsf_shared_malloc(tlsf_shared_t *s, size_t size)
+{
+    if (!shared_lock(s))
+        return NULL;
+    void *p = tlsf_malloc(&s->tlsf, size);
+    shared_unlock(s);
+    return p;
+}
+
+void *tlsf_shared_aalloc(tlsf_shared_t *s, size_t align, size_t size)
+{
+    if (!shared_lock(s))
+        return NULL;
+    void *p = tlsf_aalloc(&s->tlsf, align, size);
+    shared_unlock(s);
+    return p;
+}
+
+void *tlsf_shared_realloc(tlsf_shared_t *s, void *mem, size_t size)
+{
+    if (!shared_lock(s))
+        return NULL;
+    void *p = tlsf_realloc(&s->tlsf, mem, size);
+    shared_unlock(s);
+    return p;
+}
+
+void tlsf_shared_free(tlsf_shared_t *s, void *mem)
+{
+    if (!shared_lock(s))
+        return;
+    tlsf_free(&s->tlsf, mem);
+    shared_unlock(s);
+}
@@ -0,0 +1,73 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#ifndef TLSF_ENABLE_PIC
+#error "tlsf_shared requires TLSF_ENABLE_PIC"
+#endif
+
+#include <pthread.h>
+
+#include "tlsf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Header placed at the start of a shared memory segment (memfd, shm_open).
+ * The arena follows it in the same segment, so every process may map the
+ * segment at a different address.
+ *
+ * The tlsf_t holds no process-local pointers, so the processes need not run
+ * the same binary: each installs its own backend only while it holds the
+ * lock. Use it only through the tlsf_shared_* calls, without a profiler,
+ * page allocations, an index or a low watermark callback.
+ */
+typedef struct {
+    pthread_mutex_t lock; /* process-shared, robust */
+    size_t capacity;      /* arena bytes available after the header */
+    tlsf_t tlsf;
+} tlsf_shared_t;
+
+/**
+ * Initialize a new shared heap covering the segment at @mem.
+ * Must be called by exactly one process before any other uses the segment.
+ *
+ * @return The heap header, or NULL if the segment is too small or the lock
+ *         cannot be created
+ */
+tlsf_shared_t *tlsf_shared_init(void *mem, size_t size);
+
+/**
+ * Use a shared heap previously initialized by another process, mapped at
+ * @mem in the calling process.
+ *
+ * @return The heap header, or NULL if @mem does not hold a shared heap
+ */
+tlsf_shared_t *tlsf_shared_attach(void *mem);
+
+/* Locked counterparts of the tlsf_t API. They return NULL (or do nothing)
+ * if a process died inside the allocator and left the heap inconsistent.
+ */
+void *tlsf_shared_malloc(tlsf_shared_t *, size_t size);
+void *tlsf_shared_aalloc(tlsf_shared_t *, size_t align, size_t size);
+void *tlsf_shared_realloc(tlsf_shared_t *, void *, size_t);
+void tlsf_shared_free(tlsf_shared_t *, void *);
+void tlsf_shared_check(tlsf_shared_t *);
+
+/* Pointers cannot be exchanged between processes, offsets can. */
+static inline size_t tlsf_shared_offset(const tlsf_shared_t *s, const void *p)
+{
+    return (size_t) ((const char *) p - (const char *) s);
+}
+
+static inline void *tlsf_shared_ptr(tlsf_shared_t *s, size_t offset)
+{
+    return (char *) s + offset;
+}
+
+#ifdef __cplusplus
+}
+#endif
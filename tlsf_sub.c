@@ -0,0 +1,54 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "tlsf_sub.h"
+
+typedef struct {
+    tlsf_t *parent;
+    size_t reserve, capacity;
+    tlsf_t tlsf;
+} sub_heap_t;
+
+/* Offset of the arena from the start of the block. */
+#define SUB_ARENA ((sizeof(sub_heap_t) + 15) & ~(size_t) 15)
+
+static sub_heap_t *sub_heap(tlsf_t *t)
+{
+    return (sub_heap_t *) ((char *) t - offsetof(sub_heap_t, tlsf));
+}
+
+static void *sub_resize(tlsf_t *t, size_t size)
+{
+    sub_heap_t *s = sub_heap(t);
+    size_t need = size < s->reserve ? s->reserve : size;
+    if (need > s->capacity) {
+        if (need > TLSF_MAX_SIZE - SUB_ARENA ||
+            !tlsf_try_expand(s->parent, s, SUB_ARENA + need))
+            return NULL;
+    } else if (need < s->capacity) {
+        tlsf_shrink_in_place(s->parent, s, SUB_ARENA + need);
+    }
+    s->capacity = need;
+    return (char *) s + SUB_ARENA;
+}
+
+tlsf_t *tlsf_sub_create(tlsf_t *parent, size_t reserve)
+{
+    if (reserve > TLSF_MAX_SIZE - SUB_ARENA)
+        return NULL;
+    sub_heap_t *s = (sub_heap_t *) tlsf_malloc(parent, SUB_ARENA + reserve);
+    if (!s)
+        return NULL;
+    s->parent = parent;
+    s->reserve = s->capacity = reserve;
+    s->tlsf = TLSF_INIT;
+    s->tlsf.resize = sub_resize;
+    return &s->tlsf;
+}
+
+void tlsf_sub_destroy(tlsf_t *t)
+{
+    if (t)
+        tlsf_free(sub_heap(t)->parent, sub_heap(t));
+}
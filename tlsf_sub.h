@@ -0,0 +1,39 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include "tlsf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Sub-heaps live in a single block of a parent heap: the tlsf_t comes first,
+ * followed by the arena. The arena grows and shrinks by resizing that block
+ * in place, so a sub-heap needs no backend of its own, and destroying it
+ * returns all of its memory to the parent at once.
+ *
+ * Growth fails once the parent has placed another allocation right after
+ * the block, so sub-heaps which must keep growing should be created with a
+ * @reserve. Nesting is supported, a sub-heap may be the parent of another.
+ */
+
+/**
+ * Create an empty sub-heap of @parent, which keeps at least @reserve bytes
+ * of arena allocated while it exists.
+ *
+ * @return The sub-heap, or NULL if the parent is out of memory
+ */
+tlsf_t *tlsf_sub_create(tlsf_t *parent, size_t reserve);
+
+/**
+ * Free the sub-heap and everything allocated from it with a single
+ * tlsf_free() on the parent.
+ */
+void tlsf_sub_destroy(tlsf_t *);
+
+#ifdef __cplusplus
+}
+#endif